@@ -0,0 +1,206 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hist.h"
+
+#define INIT_SIZE	1024
+
+static int resize(struct histogram *hist, int newsz);
+
+static int hash(uint32_t rgb, int size)
+{
+	uint32_t h = rgb * 2654435761u;
+	return (h ^ (h >> 16)) & (size - 1);
+}
+
+int init_histogram(struct histogram *hist)
+{
+	hist->count = 0;
+	hist->size = 0;
+	hist->ent = 0;
+	return resize(hist, INIT_SIZE);
+}
+
+void destroy_histogram(struct histogram *hist)
+{
+	free(hist->ent);
+	hist->ent = 0;
+	hist->size = hist->count = 0;
+}
+
+static int resize(struct histogram *hist, int newsz)
+{
+	int i, idx;
+	struct histent *newent;
+
+	if(!(newent = calloc(newsz, sizeof *newent))) {
+		fprintf(stderr, "failed to allocate color histogram (%d entries)\n", newsz);
+		return -1;
+	}
+
+	for(i=0; i<hist->size; i++) {
+		if(!hist->ent[i].count) continue;
+
+		idx = hash(hist->ent[i].rgb, newsz);
+		while(newent[idx].count) {
+			idx = (idx + 1) & (newsz - 1);
+		}
+		newent[idx] = hist->ent[i];
+	}
+
+	free(hist->ent);
+	hist->ent = newent;
+	hist->size = newsz;
+	return 0;
+}
+
+int hist_add(struct histogram *hist, uint32_t rgb, uint32_t count)
+{
+	int idx = hash(rgb, hist->size);
+
+	while(hist->ent[idx].count) {
+		if(hist->ent[idx].rgb == rgb) {
+			hist->ent[idx].count += count;
+			return 0;
+		}
+		idx = (idx + 1) & (hist->size - 1);
+	}
+
+	hist->ent[idx].rgb = rgb;
+	hist->ent[idx].count = count;
+
+	/* keep the load factor under 1/2 to keep the probe sequences short */
+	if(++hist->count > hist->size / 2) {
+		return resize(hist, hist->size * 2);
+	}
+	return 0;
+}
+
+int hist_lookup(struct histogram *hist, uint32_t rgb)
+{
+	int idx = hash(rgb, hist->size);
+
+	while(hist->ent[idx].count) {
+		if(hist->ent[idx].rgb == rgb) {
+			return idx;
+		}
+		idx = (idx + 1) & (hist->size - 1);
+	}
+	return -1;
+}
+
+int hist_add_rows(struct histogram *hist, struct image *img, int y0, int y1)
+{
+	int i, j;
+	unsigned char *rgb, *src;
+	uint32_t col, prev = 0;
+	uint32_t run = 0;
+
+	if(!(rgb = malloc(img->width * 3))) {
+		fprintf(stderr, "failed to allocate histogram scanline buffer\n");
+		return -1;
+	}
+
+	/* count runs of identical pixels before hitting the hash table */
+	for(i=y0; i<y1; i++) {
+		get_row_rgb(img, i, 0, img->width, rgb);
+		src = rgb;
+		for(j=0; j<img->width; j++) {
+			col = PACK_RGB(src[0], src[1], src[2]);
+			src += 3;
+			if(run && col == prev) {
+				run++;
+				continue;
+			}
+			if(run && hist_add(hist, prev, run) == -1) {
+				free(rgb);
+				return -1;
+			}
+			prev = col;
+			run = 1;
+		}
+	}
+	free(rgb);
+
+	if(run && hist_add(hist, prev, run) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+int hist_merge(struct histogram *hist, struct histogram *src)
+{
+	int i;
+
+	for(i=0; i<src->size; i++) {
+		if(src->ent[i].count && hist_add(hist, src->ent[i].rgb, src->ent[i].count) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* LSD radix sort on the 24bit color value, 8 bits per pass */
+struct histent *hist_sorted(struct histogram *hist)
+{
+	int i, pass, shift, sum, tmp;
+	int offs[256];
+	struct histent *res, *buf, *src, *dest;
+
+	if(!(res = malloc((hist->count ? hist->count : 1) * 2 * sizeof *res))) {
+		fprintf(stderr, "failed to allocate sorted color histogram\n");
+		return 0;
+	}
+	buf = res + hist->count;
+
+	dest = res;
+	for(i=0; i<hist->size; i++) {
+		if(hist->ent[i].count) {
+			*dest++ = hist->ent[i];
+		}
+	}
+
+	src = res;
+	dest = buf;
+	for(pass=0; pass<3; pass++) {
+		shift = pass * 8;
+
+		memset(offs, 0, sizeof offs);
+		for(i=0; i<hist->count; i++) {
+			offs[(src[i].rgb >> shift) & 0xff]++;
+		}
+		sum = 0;
+		for(i=0; i<256; i++) {
+			tmp = offs[i];
+			offs[i] = sum;
+			sum += tmp;
+		}
+		for(i=0; i<hist->count; i++) {
+			dest[offs[(src[i].rgb >> shift) & 0xff]++] = src[i];
+		}
+
+		dest = src;
+		src = src == res ? buf : res;
+	}
+
+	/* odd number of passes: the result ended up in the second half */
+	memcpy(res, src, hist->count * sizeof *res);
+	return res;
+}
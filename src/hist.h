@@ -0,0 +1,59 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HIST_H_
+#define HIST_H_
+
+#include <stdint.h>
+#include "image.h"
+
+#define PACK_RGB(r, g, b)	(((uint32_t)(r) << 16) | ((uint32_t)(g) << 8) | (uint32_t)(b))
+#define UNPACK_R(c)			((int)((c) >> 16) & 0xff)
+#define UNPACK_G(c)			((int)((c) >> 8) & 0xff)
+#define UNPACK_B(c)			((int)(c) & 0xff)
+
+struct histent {
+	uint32_t rgb;
+	uint32_t count;		/* 0 marks an empty hash table slot */
+};
+
+/* color histogram: open-addressing hash table of unique 24bit colors */
+struct histogram {
+	struct histent *ent;
+	int size;			/* table size, always a power of two */
+	int count;			/* number of unique colors */
+};
+
+int init_histogram(struct histogram *hist);
+void destroy_histogram(struct histogram *hist);
+
+/* returns -1 on allocation failure */
+int hist_add(struct histogram *hist, uint32_t rgb, uint32_t count);
+/* returns the table slot holding rgb, or -1 if it's not in the histogram */
+int hist_lookup(struct histogram *hist, uint32_t rgb);
+
+/* adds the pixels of scanlines [y0, y1) */
+int hist_add_rows(struct histogram *hist, struct image *img, int y0, int y1);
+/* adds all colors of src to hist */
+int hist_merge(struct histogram *hist, struct histogram *src);
+
+/* returns a newly allocated array of the hist->count unique colors, sorted by
+ * color value, so that anything built from it doesn't depend on hash order
+ */
+struct histent *hist_sorted(struct histogram *hist);
+
+#endif	/* HIST_H_ */
@@ -20,8 +20,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <png.h>
+#include <zlib.h>
 #include "image.h"
+#include "pixconv.h"
+#include "pngenc.h"
+#include "rawimg.h"
+#include "util.h"
 
 int alloc_image(struct image *img, int x, int y, int bpp)
 {
@@ -29,7 +36,7 @@ int alloc_image(struct image *img, int x, int y, int bpp)
 	img->width = x;
 	img->height = y;
 	img->bpp = bpp;
-	img->scansz = img->pitch = x * (bpp == 15 ? 16 : bpp) / 8;
+	img->scansz = img->pitch = (x * (bpp == 15 ? 16 : bpp) + 7) / 8;
 
 	if(!(img->pixels = malloc(y * img->scansz))) {
 		fprintf(stderr, "failed to allocate %dx%d (%dbpp) pixel buffer\n", x, y, bpp);
@@ -50,16 +57,168 @@ int alloc_image(struct image *img, int x, int y, int bpp)
 	return 0;
 }
 
-int load_image(struct image *img, const char *fname)
+void free_pixels(struct image *img)
+{
+	if(img->mapping) {
+		munmap(img->mapping, img->mapsz);
+	} else {
+		free(img->pixels);
+	}
+	img->pixels = 0;
+	img->mapping = 0;
+	img->mapsz = 0;
+}
+
+int unmap_image(struct image *img)
 {
 	int i;
-	FILE *fp;
-	png_struct *png;
-	png_info *info;
+	unsigned char *pixels, *src;
+
+	if(!img->mapping) {
+		return 0;
+	}
+	if(!(pixels = malloc(img->height * img->scansz))) {
+		return -1;
+	}
+	src = img->pixels;
+	for(i=0; i<img->height; i++) {
+		memcpy(pixels + i * img->scansz, src, img->scansz);
+		src += img->pitch;
+	}
+	free_pixels(img);
+	img->pixels = pixels;
+	img->pitch = img->scansz;
+	return 0;
+}
+
+int save_zlevel = -1;
+int save_filter = -1;
+int save_zstrategy = -1;
+int save_parallel = 0;
+int save_raw = 0;
+
+static const char *filter_names[] = {"none", "sub", "up", "avg", "paeth", "adaptive"};
+static const int filter_flags[] = {
+	PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS
+};
+
+static const struct {
+	const char *name;
+	int strategy;
+} zstrategy_names[] = {
+	{"default", Z_DEFAULT_STRATEGY},
+	{"filtered", Z_FILTERED},
+	{"huffman", Z_HUFFMAN_ONLY},
+	{"rle", Z_RLE},
+	{"fixed", Z_FIXED}
+};
+
+int save_filter_from_name(const char *name)
+{
+	int i;
+
+	for(i=0; i<sizeof filter_names / sizeof *filter_names; i++) {
+		if(strcmp(name, filter_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int save_zstrategy_from_name(const char *name)
+{
+	int i;
+
+	for(i=0; i<sizeof zstrategy_names / sizeof *zstrategy_names; i++) {
+		if(strcmp(name, zstrategy_names[i].name) == 0) {
+			return zstrategy_names[i].strategy;
+		}
+	}
+	return -1;
+}
+
+/* fills in the image format from the PNG header, after png_read_update_info */
+static int read_header(png_struct *png, png_info *info, struct image *img)
+{
 	int chan_bits, color_type;
 	png_uint_32 xsz, ysz;
 	png_color *palette;
-	unsigned char **scanline;
+
+	png_get_IHDR(png, info, &xsz, &ysz, &chan_bits, &color_type, 0, 0, 0);
+	img->width = xsz;
+	img->height = ysz;
+	img->nchan = png_get_channels(png, info);
+	img->bpp = img->nchan * chan_bits;
+	img->scansz = img->pitch = (xsz * img->bpp + 7) / 8;
+	img->cmap_ncolors = 0;
+	img->pixels = 0;
+	img->mapping = 0;
+	img->mapsz = 0;
+
+	if(color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_get_PLTE(png, info, &palette, &img->cmap_ncolors);
+		memcpy(img->cmap, palette, img->cmap_ncolors * sizeof *img->cmap);
+	}
+
+	return png_get_rowbytes(png, info) == img->scansz ? 0 : -1;
+}
+
+static void write_header(png_struct *png, png_info *info, struct image *img)
+{
+	int chan_bits, coltype;
+	png_text txt;
+
+	txt.compression = PNG_TEXT_COMPRESSION_NONE;
+	txt.key = "Software";
+	txt.text = "pngdump";
+	txt.text_length = 0;
+
+	switch(img->nchan) {
+	case 1:
+		if(img->cmap_ncolors > 0) {
+			coltype = PNG_COLOR_TYPE_PALETTE;
+		} else {
+			coltype = PNG_COLOR_TYPE_GRAY;
+		}
+		break;
+	case 2:
+		coltype = PNG_COLOR_TYPE_GRAY_ALPHA;
+		break;
+	case 3:
+		coltype = PNG_COLOR_TYPE_RGB;
+		break;
+	case 4:
+	default:
+		coltype = PNG_COLOR_TYPE_RGB_ALPHA;
+		break;
+	}
+
+	chan_bits = img->bpp / img->nchan;
+	png_set_IHDR(png, info, img->width, img->height, chan_bits, coltype, PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_text(png, info, &txt, 1);
+
+	if(img->cmap_ncolors > 0) {
+		png_set_PLTE(png, info, (png_color*)img->cmap, img->cmap_ncolors);
+	}
+
+	if(save_zlevel >= 0) {
+		png_set_compression_level(png, save_zlevel);
+	}
+	if(save_zstrategy >= 0) {
+		png_set_compression_strategy(png, save_zstrategy);
+	}
+	if(save_filter >= 0) {
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, filter_flags[save_filter]);
+	}
+}
+
+int load_image(struct image *img, const char *fname)
+{
+	int i, pass, npasses, res;
+	FILE *fp;
+	png_struct *png;
+	png_info *info;
 	unsigned char *dptr;
 
 	if(!(fp = fopen(fname, "rb"))) {
@@ -67,6 +226,12 @@ int load_image(struct image *img, const char *fname)
 		return -1;
 	}
 
+	if(is_raw_image(fp)) {
+		res = load_raw_image(img, fp, fname);
+		fclose(fp);
+		return res;
+	}
+
 	if(!(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
 		fclose(fp);
 		return -1;
@@ -76,41 +241,47 @@ int load_image(struct image *img, const char *fname)
 		png_destroy_read_struct(&png, 0, 0);
 		return -1;
 	}
+	img->pixels = 0;
 	if(setjmp(png_jmpbuf(png))) {
+		free(img->pixels);
+		img->pixels = 0;
 		fclose(fp);
 		png_destroy_read_struct(&png, &info, 0);
 		return -1;
 	}
 
 	png_init_io(png, fp);
-	png_read_png(png, info, 0, 0);
+	png_read_info(png, info);
 
-	png_get_IHDR(png, info, &xsz, &ysz, &chan_bits, &color_type, 0, 0, 0);
-	img->width = xsz;
-	img->height = ysz;
-	img->nchan = png_get_channels(png, info);
-	img->bpp = img->nchan * chan_bits;
-	img->scansz = img->pitch = xsz * img->bpp / 8;
-	img->cmap_ncolors = 0;
+	/* no transforms, we keep the pixels in the file format. Interlaced images
+	 * are assembled by libpng in place, over the course of all passes.
+	 */
+	npasses = png_set_interlace_handling(png);
+	png_read_update_info(png, info);
 
-	if(color_type == PNG_COLOR_TYPE_PALETTE) {
-		png_get_PLTE(png, info, &palette, &img->cmap_ncolors);
-		memcpy(img->cmap, palette, img->cmap_ncolors * sizeof *img->cmap);
+	if(read_header(png, info, img) == -1) {
+		fprintf(stderr, "%s: unexpected scanline size\n", fname);
+		fclose(fp);
+		png_destroy_read_struct(&png, &info, 0);
+		return -1;
 	}
 
-	if(!(img->pixels = malloc(ysz * img->scansz))) {
+	/* decode straight into our pixel buffer, without an intermediate copy */
+	if(!(img->pixels = malloc(img->height * img->scansz))) {
 		perror("failed to allocate pixel buffer");
 		fclose(fp);
 		png_destroy_read_struct(&png, &info, 0);
 		return -1;
 	}
-	dptr = img->pixels;
 
-	scanline = (unsigned char**)png_get_rows(png, info);
-	for(i=0; i<ysz; i++) {
-		memcpy(dptr, scanline[i], img->scansz);
-		dptr += img->pitch;
+	for(pass=0; pass<npasses; pass++) {
+		dptr = img->pixels;
+		for(i=0; i<img->height; i++) {
+			png_read_row(png, dptr, 0);
+			dptr += img->pitch;
+		}
 	}
+	png_read_end(png, 0);
 
 	fclose(fp);
 	png_destroy_read_struct(&png, &info, 0);
@@ -133,66 +304,50 @@ int save_image(struct image *img, const char *fname)
 
 int save_image_file(struct image *img, FILE *fp)
 {
-	int i, chan_bits, coltype;
+	int i;
+	double t0;
 	png_struct *png;
 	png_info *info;
-	png_text txt;
 	unsigned char **scanline = 0;
 	unsigned char *pptr;
 
+	if(save_raw) {
+		return save_raw_image_file(img, fp);
+	}
+
 	if(!(png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
-		fclose(fp);
 		return -1;
 	}
 	if(!(info = png_create_info_struct(png))) {
 		png_destroy_write_struct(&png, 0);
-		fclose(fp);
 		return -1;
 	}
 
-	txt.compression = PNG_TEXT_COMPRESSION_NONE;
-	txt.key = "Software";
-	txt.text = "pngdump";
-	txt.text_length = 0;
-
 	if(setjmp(png_jmpbuf(png))) {
 		png_destroy_write_struct(&png, &info);
 		free(scanline);
-		fclose(fp);
 		return -1;
 	}
 
-	switch(img->nchan) {
-	case 1:
-		if(img->cmap_ncolors > 0) {
-			coltype = PNG_COLOR_TYPE_PALETTE;
-		} else {
-			coltype = PNG_COLOR_TYPE_GRAY;
-		}
-		break;
-	case 2:
-		coltype = PNG_COLOR_TYPE_GRAY_ALPHA;
-		break;
-	case 3:
-		coltype = PNG_COLOR_TYPE_RGB;
-		break;
-	case 4:
-		coltype = PNG_COLOR_TYPE_RGB_ALPHA;
-		break;
-	}
-
-	chan_bits = img->bpp / img->nchan;
-	png_set_IHDR(png, info, img->width, img->height, chan_bits, coltype, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	png_set_text(png, info, &txt, 1);
+	write_header(png, info, img);
+	png_init_io(png, fp);
+	t0 = get_msec();
 
-	if(img->cmap_ncolors > 0) {
-		png_set_PLTE(png, info, (png_color*)img->cmap, img->cmap_ncolors);
+	if(save_parallel) {
+		png_write_info(png, info);
+		if(write_idat_parallel(png, img) == -1) {
+			png_destroy_write_struct(&png, &info);
+			return -1;
+		}
+		/* png_write_end insists on IDATs written through libpng */
+		png_write_chunk(png, (png_const_bytep)"IEND", 0, 0);
+		png_destroy_write_struct(&png, &info);
+		VERBOSE_TIME(t0, "parallel PNG encoding");
+		return 0;
 	}
 
 	if(!(scanline = malloc(img->height * sizeof *scanline))) {
 		png_destroy_write_struct(&png, &info);
-		fclose(fp);
 		return -1;
 	}
 
@@ -203,13 +358,169 @@ int save_image_file(struct image *img, FILE *fp)
 	}
 	png_set_rows(png, info, scanline);
 
-	png_init_io(png, fp);
 	png_write_png(png, info, 0, 0);
 	png_destroy_write_struct(&png, &info);
 	free(scanline);
+	VERBOSE_TIME(t0, "PNG encoding");
 	return 0;
 }
 
+/* Progressive reading and writing. libpng errors longjmp back to the setjmp of
+ * the function which called into it, so each of these sets its own.
+ */
+int open_image_stream(struct image_stream *is, struct image *img, const char *fname)
+{
+	png_struct *png;
+	png_info *info;
+
+	if(!(is->fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "failed to open: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(is_raw_image(is->fp)) {
+		fprintf(stderr, "%s: raw images are mapped rather than loaded, they can't be streamed\n", fname);
+		fclose(is->fp);
+		return -1;
+	}
+	if(!(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
+		fclose(is->fp);
+		return -1;
+	}
+	if(!(info = png_create_info_struct(png))) {
+		png_destroy_read_struct(&png, 0, 0);
+		fclose(is->fp);
+		return -1;
+	}
+	is->png = png;
+	is->info = info;
+	is->write = 0;
+	is->y = 0;
+
+	if(setjmp(png_jmpbuf(png))) {
+		close_image_stream(is);
+		return -1;
+	}
+
+	png_init_io(png, is->fp);
+	png_read_info(png, info);
+
+	/* interlaced images aren't complete until the last pass */
+	if(png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+		fprintf(stderr, "%s: interlaced images can't be read progressively\n", fname);
+		close_image_stream(is);
+		return -1;
+	}
+	png_read_update_info(png, info);
+
+	if(read_header(png, info, img) == -1) {
+		fprintf(stderr, "%s: unexpected scanline size\n", fname);
+		close_image_stream(is);
+		return -1;
+	}
+	is->height = img->height;
+	return 0;
+}
+
+/* reads the next nrows scanlines into img->pixels */
+int read_image_rows(struct image_stream *is, struct image *img, int nrows)
+{
+	int i;
+	unsigned char *dptr = img->pixels;
+
+	if(is->y + nrows > is->height) {
+		return -1;
+	}
+	if(setjmp(png_jmpbuf((png_struct*)is->png))) {
+		return -1;
+	}
+
+	for(i=0; i<nrows; i++) {
+		png_read_row(is->png, dptr, 0);
+		dptr += img->pitch;
+	}
+	is->y += nrows;
+	return 0;
+}
+
+/* starts writing a PNG file in the format of img, the pixels are not used */
+int create_image_stream(struct image_stream *is, struct image *img, FILE *fp)
+{
+	png_struct *png;
+	png_info *info;
+
+	if(!(png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
+		return -1;
+	}
+	if(!(info = png_create_info_struct(png))) {
+		png_destroy_write_struct(&png, 0);
+		return -1;
+	}
+	is->fp = 0;
+	is->png = png;
+	is->info = info;
+	is->write = 1;
+	is->y = 0;
+	is->height = img->height;
+
+	if(setjmp(png_jmpbuf(png))) {
+		close_image_stream(is);
+		return -1;
+	}
+
+	png_init_io(png, fp);
+	write_header(png, info, img);
+	png_write_info(png, info);
+	return 0;
+}
+
+/* appends the first nrows scanlines of img */
+int write_image_rows(struct image_stream *is, struct image *img, int nrows)
+{
+	int i;
+	unsigned char *sptr = img->pixels;
+
+	if(is->y + nrows > is->height) {
+		return -1;
+	}
+	if(setjmp(png_jmpbuf((png_struct*)is->png))) {
+		return -1;
+	}
+
+	for(i=0; i<nrows; i++) {
+		png_write_row(is->png, sptr);
+		sptr += img->pitch;
+	}
+	is->y += nrows;
+	return 0;
+}
+
+/* Finishes the file when writing, if all scanlines were written. Files opened
+ * for reading are closed, output files are left for the caller to close.
+ */
+int close_image_stream(struct image_stream *is)
+{
+	png_struct *png = is->png;
+	png_info *info = is->info;
+
+	if(!png) return -1;
+	is->png = is->info = 0;
+
+	if(is->write) {
+		if(is->y >= is->height) {
+			if(setjmp(png_jmpbuf(png))) {
+				png_destroy_write_struct(&png, &info);
+			return -1;
+			}
+			png_write_end(png, info);
+		}
+		png_destroy_write_struct(&png, &info);
+		return is->y >= is->height ? 0 : -1;
+	}
+
+	png_destroy_read_struct(&png, &info, 0);
+	fclose(is->fp);
+	return 0;
+}
 
 int cmp_image(struct image *a, struct image *b)
 {
@@ -297,25 +608,25 @@ unsigned int get_pixel(struct image *img, int x, int y)
 
 unsigned int get_pixel_rgb(struct image *img, int x, int y, unsigned int *rgb)
 {
+	unsigned char rgb24[3];
+	uint16_t pix16;
 	unsigned int pix = get_pixel(img, x, y);
 
 	switch(img->bpp) {
 	case 15:
-		rgb[0] = (pix & 0x7c00) >> 7;
-		rgb[1] = (pix & 0x03e0) >> 2;
-		rgb[2] = (pix & 0x001f) << 3;
-		rgb[0] |= ((rgb[0] & 8) >> 1) | ((rgb[0] & 8) >> 2) | ((rgb[0] & 8) >> 3);
-		rgb[1] |= ((rgb[1] & 8) >> 1) | ((rgb[1] & 8) >> 2) | ((rgb[1] & 8) >> 3);
-		rgb[2] |= ((rgb[2] & 8) >> 1) | ((rgb[2] & 8) >> 2) | ((rgb[2] & 8) >> 3);
+		pix16 = pix;
+		conv_bgr555_rgb24(&pix16, rgb24, 1);
+		rgb[0] = rgb24[0];
+		rgb[1] = rgb24[1];
+		rgb[2] = rgb24[2];
 		break;
 
 	case 16:
-		rgb[0] = (pix & 0xf800) >> 8;
-		rgb[1] = (pix & 0x07e0) >> 3;
-		rgb[2] = (pix & 0x001f) << 3;
-		rgb[0] |= ((rgb[0] & 8) >> 1) | ((rgb[0] & 8) >> 2) | ((rgb[0] & 8) >> 3);
-		rgb[1] |= ((rgb[1] & 4) >> 1) | ((rgb[1] & 4) >> 2);
-		rgb[2] |= ((rgb[2] & 8) >> 1) | ((rgb[2] & 8) >> 2) | ((rgb[2] & 8) >> 3);
+		pix16 = pix;
+		conv_rgb565_rgb24(&pix16, rgb24, 1);
+		rgb[0] = rgb24[0];
+		rgb[1] = rgb24[1];
+		rgb[2] = rgb24[2];
 		break;
 
 	case 24:
@@ -375,12 +686,12 @@ void put_pixel_rgb(struct image *img, int x, int y, unsigned int *rgb)
 	switch(img->bpp) {
 	case 15:
 		pptr16 = (unsigned short*)(img->pixels + y * img->pitch + x * 2);
-		*pptr16 = ((rgb[0] & 0xf8) << 7) | ((rgb[1] & 0xf8) << 2) | ((rgb[2] * 0xf8) >> 3);
+		*pptr16 = ((rgb[0] & 0xf8) >> 3) | ((rgb[1] & 0xf8) << 2) | ((rgb[2] & 0xf8) << 7);
 		break;
 
 	case 16:
 		pptr16 = (unsigned short*)(img->pixels + y * img->pitch + x * 2);
-		*pptr16 = ((rgb[0] & 0xf8) << 8) | ((rgb[1] & 0xfc) << 3) | ((rgb[2] * 0xf8) >> 3);
+		*pptr16 = ((rgb[0] & 0xf8) << 8) | ((rgb[1] & 0xfc) << 3) | ((rgb[2] & 0xf8) >> 3);
 		break;
 
 	case 24:
@@ -400,21 +711,256 @@ void put_pixel_rgb(struct image *img, int x, int y, unsigned int *rgb)
 	}
 }
 
+/* scanline spans, one specialized loop per pixel format */
+
+static void get_row4(unsigned char *src, int x0, int n, unsigned int *pix)
+{
+	int i;
+
+	src += x0 >> 1;
+	if(x0 & 1) {
+		*pix++ = *src++ & 0xf;
+		n--;
+	}
+	for(i=0; i<n>>1; i++) {
+		*pix++ = *src >> 4;
+		*pix++ = *src++ & 0xf;
+	}
+	if(n & 1) {
+		*pix = *src >> 4;
+	}
+}
+
+static void get_row_rgb4(unsigned char *src, int x0, int n, unsigned char *rgb, struct cmapent *cmap)
+{
+	int i;
+	struct cmapent *c;
+
+	src += x0 >> 1;
+	for(i=0; i<n; i++) {
+		c = cmap + ((x0 + i) & 1 ? *src++ & 0xf : *src >> 4);
+		*rgb++ = c->r;
+		*rgb++ = c->g;
+		*rgb++ = c->b;
+	}
+}
+
+static void get_row_rgb8(unsigned char *src, int n, unsigned char *rgb, struct cmapent *cmap)
+{
+	int i;
+	struct cmapent *c;
+
+	for(i=0; i<n; i++) {
+		c = cmap + *src++;
+		*rgb++ = c->r;
+		*rgb++ = c->g;
+		*rgb++ = c->b;
+	}
+}
+
+static void get_row_rgb32(unsigned char *src, int n, unsigned char *rgb)
+{
+	int i;
+
+	for(i=0; i<n; i++) {
+		*rgb++ = src[0];
+		*rgb++ = src[1];
+		*rgb++ = src[2];
+		src += 4;
+	}
+}
+
+void get_row(struct image *img, int y, int x0, int n, unsigned int *pix)
+{
+	int i;
+	unsigned char *src = img->pixels + y * img->pitch;
+	uint16_t *src16;
+	uint32_t *src32;
+
+	switch(img->bpp) {
+	case 4:
+		get_row4(src, x0, n, pix);
+		break;
+	case 8:
+		src += x0;
+		for(i=0; i<n; i++) {
+			*pix++ = *src++;
+		}
+		break;
+	case 15:
+	case 16:
+		src16 = (uint16_t*)src + x0;
+		for(i=0; i<n; i++) {
+			*pix++ = *src16++;
+		}
+		break;
+	case 24:
+		src += x0 * 3;
+		for(i=0; i<n; i++) {
+			*pix++ = src[0] | (src[1] << 8) | ((unsigned int)src[2] << 16);
+			src += 3;
+		}
+		break;
+	case 32:
+		src32 = (uint32_t*)src + x0;
+		for(i=0; i<n; i++) {
+			*pix++ = *src32++;
+		}
+		break;
+	default:
+		fprintf(stderr, "get_row not implemented for %d bpp\n", img->bpp);
+	}
+}
+
+void get_row_rgb(struct image *img, int y, int x0, int n, unsigned char *rgb)
+{
+	unsigned char *src = img->pixels + y * img->pitch;
+
+	switch(img->bpp) {
+	case 4:
+		get_row_rgb4(src, x0, n, rgb, img->cmap);
+		break;
+	case 8:
+		get_row_rgb8(src + x0, n, rgb, img->cmap);
+		break;
+	case 15:
+		conv_bgr555_rgb24((uint16_t*)src + x0, rgb, n);
+		break;
+	case 16:
+		conv_rgb565_rgb24((uint16_t*)src + x0, rgb, n);
+		break;
+	case 24:
+		memcpy(rgb, src + x0 * 3, n * 3);
+		break;
+	case 32:
+		get_row_rgb32(src + x0 * 4, n, rgb);
+		break;
+	default:
+		fprintf(stderr, "get_row_rgb not implemented for %d bpp\n", img->bpp);
+	}
+}
+
+static void put_row4(unsigned char *dest, int x0, int n, const unsigned int *pix)
+{
+	int i;
+
+	dest += x0 >> 1;
+	if(x0 & 1) {
+		*dest = (*dest & 0xf0) | *pix++;
+		dest++;
+		n--;
+	}
+	for(i=0; i<n>>1; i++) {
+		*dest++ = (pix[0] << 4) | pix[1];
+		pix += 2;
+	}
+	if(n & 1) {
+		*dest = (*dest & 0xf) | (*pix << 4);
+	}
+}
+
+void put_row(struct image *img, int y, int x0, int n, const unsigned int *pix)
+{
+	int i;
+	unsigned char *dest = img->pixels + y * img->pitch;
+	uint16_t *dest16;
+	uint32_t *dest32;
+
+	switch(img->bpp) {
+	case 4:
+		put_row4(dest, x0, n, pix);
+		break;
+	case 8:
+		dest += x0;
+		for(i=0; i<n; i++) {
+			*dest++ = *pix++;
+		}
+		break;
+	case 15:
+	case 16:
+		dest16 = (uint16_t*)dest + x0;
+		for(i=0; i<n; i++) {
+			*dest16++ = *pix++;
+		}
+		break;
+	case 24:
+		dest += x0 * 3;
+		for(i=0; i<n; i++) {
+			*dest++ = *pix;
+			*dest++ = *pix >> 8;
+			*dest++ = *pix++ >> 16;
+		}
+		break;
+	case 32:
+		dest32 = (uint32_t*)dest + x0;
+		for(i=0; i<n; i++) {
+			*dest32++ = *pix++;
+		}
+		break;
+	default:
+		fprintf(stderr, "put_row not implemented for %d bpp\n", img->bpp);
+	}
+}
+
+static void put_row_index4(unsigned char *dest, int x0, int n, const unsigned char *idx)
+{
+	int i;
+
+	dest += x0 >> 1;
+	if(x0 & 1) {
+		*dest = (*dest & 0xf0) | *idx++;
+		dest++;
+		n--;
+	}
+	for(i=0; i<n>>1; i++) {
+		*dest++ = (idx[0] << 4) | idx[1];
+		idx += 2;
+	}
+	if(n & 1) {
+		*dest = (*dest & 0xf) | (*idx << 4);
+	}
+}
+
+void put_row_index(struct image *img, int y, int x0, int n, const unsigned char *idx)
+{
+	unsigned char *dest = img->pixels + y * img->pitch;
+
+	switch(img->bpp) {
+	case 4:
+		put_row_index4(dest, x0, n, idx);
+		break;
+	case 8:
+		memcpy(dest + x0, idx, n);
+		break;
+	default:
+		fprintf(stderr, "put_row_index not implemented for %d bpp\n", img->bpp);
+	}
+}
+
 void overlay_key(struct image *src, unsigned int key, struct image *dst)
 {
 	int i, j;
-	unsigned int pix;
+	unsigned int *srow, *drow;
 
 	assert(src->bpp == dst->bpp);
 	assert(src->width == dst->width);
 	assert(src->height == dst->height);
 
+	if(!(srow = malloc(dst->width * 2 * sizeof *srow))) {
+		fprintf(stderr, "overlay_key: failed to allocate scanline buffer\n");
+		return;
+	}
+	drow = srow + dst->width;
+
 	for(i=0; i<dst->height; i++) {
+		get_row(src, i, 0, src->width, srow);
+		get_row(dst, i, 0, dst->width, drow);
 		for(j=0; j<dst->width; j++) {
-			pix = get_pixel(src, j, i);
-			if(pix != key) {
-				put_pixel(dst, j, i, pix);
+			if(srow[j] != key) {
+				drow[j] = srow[j];
 			}
 		}
+		put_row(dst, i, 0, dst->width, drow);
 	}
+	free(srow);
 }
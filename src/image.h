@@ -33,18 +33,90 @@ struct image {
 	int cmap_ncolors;
 	struct cmapent cmap[256];
 	unsigned char *pixels;
+
+	/* mapped raw image file the pixels point into, or null if they were
+	 * allocated. See free_pixels.
+	 */
+	void *mapping;
+	size_t mapsz;
+};
+
+enum quant_method {
+	QUANT_OCTREE,
+	QUANT_WU
 };
 
 enum dither {
 	DITHER_NONE,
-	DITHER_FLOYD_STEINBERG
+	DITHER_FLOYD_STEINBERG,
+	/* ordered dithering, position dependent thresholds */
+	DITHER_BAYER2,
+	DITHER_BAYER4,
+	DITHER_BAYER8,
+	DITHER_BLUE_NOISE,
+	/* more error diffusion kernels */
+	DITHER_ATKINSON,
+	DITHER_SIERRA_LITE,
+	DITHER_JJN,
+
+	DITHER_SERPENTINE = 0x100	/* flag: error diffusion alternates scan direction */
 };
 
+/* PNG scanline filters, the first five match the PNG filter types */
+enum save_filter {
+	FILTER_NONE,
+	FILTER_SUB,
+	FILTER_UP,
+	FILTER_AVG,
+	FILTER_PAETH,
+	FILTER_ADAPTIVE		/* best of the above for each scanline */
+};
+
+#define DITHER_ORDERED(d)	((d) >= DITHER_BAYER2 && (d) <= DITHER_BLUE_NOISE)
+
 int alloc_image(struct image *img, int x, int y, int bpp);
+/* releases the pixel buffer, whether it's allocated or mapped */
+void free_pixels(struct image *img);
+/* copies the pixels of a mapped raw image to an allocated buffer and unmaps
+ * the file, which can then be overwritten
+ */
+int unmap_image(struct image *img);
+/* loads PNG files, or raw images (see rawimg.h), detected by their magic */
 int load_image(struct image *img, const char *fname);
 int save_image(struct image *img, const char *fname);
 int save_image_file(struct image *img, FILE *fp);
 
+/* progressive PNG reading and writing, a strip of scanlines at a time, for
+ * images too large to keep in memory. Interlaced files can't be read this way.
+ */
+struct image_stream {
+	FILE *fp;
+	void *png, *info;
+	int write;
+	int y, height;	/* next scanline, and total */
+};
+
+int open_image_stream(struct image_stream *is, struct image *img, const char *fname);
+int read_image_rows(struct image_stream *is, struct image *img, int nrows);
+int create_image_stream(struct image_stream *is, struct image *img, FILE *fp);
+int write_image_rows(struct image_stream *is, struct image *img, int nrows);
+int close_image_stream(struct image_stream *is);
+
+/* PNG output compression. -1 for the libpng defaults: zlib level 0-9, one of
+ * enum save_filter, and a zlib strategy (Z_FILTERED, Z_RLE...)
+ */
+extern int save_zlevel;
+extern int save_filter;
+extern int save_zstrategy;
+/* compress blocks of scanlines in parallel on the worker pool */
+extern int save_parallel;
+/* save_image and save_image_file write raw images instead of PNG */
+extern int save_raw;
+
+/* return a filter or zlib strategy for the -zf and -zs options, -1 if invalid */
+int save_filter_from_name(const char *name);
+int save_zstrategy_from_name(const char *name);
+
 int cmp_image(struct image *a, struct image *b);
 
 void blit(struct image *src, int sx, int sy, int w, int h, struct image *dst, int dx, int dy);
@@ -55,7 +127,32 @@ unsigned int get_pixel_rgb(struct image *img, int x, int y, unsigned int *rgb);
 void put_pixel(struct image *img, int x, int y, unsigned int pix);
 void put_pixel_rgb(struct image *img, int x, int y, unsigned int *rgb);
 
+/* scanline spans: n pixels of scanline y starting at x0. Pixel values are
+ * the same as get_pixel/put_pixel returns and takes, RGB is 3 bytes per pixel,
+ * and indices are 1 byte per pixel, for 4 and 8bpp images.
+ */
+void get_row(struct image *img, int y, int x0, int n, unsigned int *pix);
+void get_row_rgb(struct image *img, int y, int x0, int n, unsigned char *rgb);
+void put_row(struct image *img, int y, int x0, int n, const unsigned int *pix);
+void put_row_index(struct image *img, int y, int x0, int n, const unsigned char *idx);
+
+/* inverse colormap bits per channel used for remapping, 0 to disable */
+extern int quant_lut_bits;
+/* nearest color search method, see enum nearest_method in nearest.h */
+extern int quant_nearest;
+/* palette generator, one of enum quant_method */
+extern int quant_method;
+/* k-means palette refinement iterations, 0 to disable */
+extern int quant_refine;
+
 int quantize_image(struct image *img, int maxcol, enum dither dither,
 		int shade_levels, int *shade_lut);
+/* quantizes a PNG file strip by strip, writing it to out as PNG or raw pixels */
+int quantize_stream(const char *fname, struct image *img, FILE *out, int png, int maxcol,
+		enum dither dither);
+/* returns a dithering method and flags for the -dither option, -1 if invalid */
+int dither_from_name(const char *name);
+/* returns a palette generator for the -Q option, -1 if invalid */
+int quant_method_from_name(const char *name);
 
 #endif	/* IMAGE_H_ */
@@ -0,0 +1,139 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "invcmap.h"
+
+static int alloc_invcmap(struct invcmap *inv, int bits)
+{
+	int dim = 1 << bits;
+
+	if(bits < INVCMAP_MIN_BITS || bits > INVCMAP_MAX_BITS) {
+		fprintf(stderr, "invalid inverse colormap precision: %d bits\n", bits);
+		return -1;
+	}
+
+	inv->bits = bits;
+	inv->shift = 8 - bits;
+
+	if(!(inv->idx = malloc(dim * dim * dim))) {
+		fprintf(stderr, "failed to allocate %dx%dx%d inverse colormap\n", dim, dim, dim);
+		return -1;
+	}
+	return 0;
+}
+
+/* Builds the table by sweeping the whole cube once per palette entry, and
+ * keeping it in every cell where it's closer than anything seen so far. Squared
+ * distances along the innermost axis are updated incrementally, so the inner
+ * loop is just an add and a compare. Ties go to the lowest palette index.
+ *
+ * All coordinates are doubled, so that cell centers are integers.
+ */
+int build_invcmap(struct invcmap *inv, struct cmapent *cmap, int ncolors, int bits)
+{
+	int i, r, g, b, dim, ncells, step, half;
+	int cr, cg, cb, dr, dg, db, dist_rg, dist, inc, inc2;
+	int *distbuf, *dptr;
+	unsigned char *iptr;
+
+	if(alloc_invcmap(inv, bits) == -1) {
+		return -1;
+	}
+	dim = 1 << bits;
+	ncells = dim * dim * dim;
+
+	if(!(distbuf = malloc(ncells * sizeof *distbuf))) {
+		fprintf(stderr, "failed to allocate inverse colormap distance buffer\n");
+		free(inv->idx);
+		inv->idx = 0;
+		return -1;
+	}
+	for(i=0; i<ncells; i++) {
+		distbuf[i] = INT_MAX;
+	}
+	memset(inv->idx, 0, ncells);
+
+	step = 2 << inv->shift;		/* doubled cell size */
+	half = step / 2 - 1;		/* doubled offset of the cell center */
+	inc2 = 2 * step * step;
+
+	for(i=0; i<ncolors; i++) {
+		cr = cmap[i].r * 2;
+		cg = cmap[i].g * 2;
+		cb = cmap[i].b * 2;
+
+		dptr = distbuf;
+		iptr = inv->idx;
+		for(r=0; r<dim; r++) {
+			dr = r * step + half - cr;
+			for(g=0; g<dim; g++) {
+				dg = g * step + half - cg;
+				dist_rg = dr * dr + dg * dg;
+
+				db = half - cb;
+				dist = dist_rg + db * db;
+				inc = 2 * db * step + step * step;
+				for(b=0; b<dim; b++) {
+					if(dist < *dptr) {
+						*dptr = dist;
+						*iptr = i;
+					}
+					dptr++;
+					iptr++;
+					dist += inc;
+					inc += inc2;
+				}
+			}
+		}
+	}
+
+	free(distbuf);
+	return 0;
+}
+
+int fill_invcmap(struct invcmap *inv, int bits, int (*func)(void*, int, int, int), void *cls)
+{
+	int r, g, b, dim, half;
+	unsigned char *iptr;
+
+	if(alloc_invcmap(inv, bits) == -1) {
+		return -1;
+	}
+	dim = 1 << bits;
+	half = ((1 << inv->shift) - 1) / 2;
+
+	iptr = inv->idx;
+	for(r=0; r<dim; r++) {
+		for(g=0; g<dim; g++) {
+			for(b=0; b<dim; b++) {
+				*iptr++ = func(cls, (r << inv->shift) + half, (g << inv->shift) + half,
+						(b << inv->shift) + half);
+			}
+		}
+	}
+	return 0;
+}
+
+void destroy_invcmap(struct invcmap *inv)
+{
+	free(inv->idx);
+	inv->idx = 0;
+}
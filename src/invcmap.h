@@ -0,0 +1,43 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef INVCMAP_H_
+#define INVCMAP_H_
+
+#include "image.h"
+
+#define INVCMAP_MIN_BITS	4
+#define INVCMAP_MAX_BITS	7
+
+/* inverse colormap: a (1 << bits)^3 table mapping each cell of the RGB cube to
+ * the palette entry nearest to the center of that cell
+ */
+struct invcmap {
+	int bits, shift;
+	unsigned char *idx;
+};
+
+#define INVCMAP_LOOKUP(inv, r, g, b) \
+	((inv)->idx[((((r) >> (inv)->shift) << (inv)->bits | ((g) >> (inv)->shift)) \
+		<< (inv)->bits) | ((b) >> (inv)->shift)])
+
+int build_invcmap(struct invcmap *inv, struct cmapent *cmap, int ncolors, int bits);
+/* fills the table by calling func for the (rounded down) center of each cell */
+int fill_invcmap(struct invcmap *inv, int bits, int (*func)(void*, int, int, int), void *cls);
+void destroy_invcmap(struct invcmap *inv);
+
+#endif	/* INVCMAP_H_ */
@@ -23,6 +23,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <assert.h>
 #include "image.h"
 #include "tiles.h"
+#include "invcmap.h"
+#include "nearest.h"
+#include "util.h"
+#include "tpool.h"
+#include "pixconv.h"
 
 enum {
 	MODE_PIXELS,
@@ -34,6 +39,7 @@ enum {
 void conv_gba_image(struct image *img);
 void dump_colormap(struct image *img, int text, FILE *fp);
 void print_usage(const char *argv0);
+int is_number(const char *s);
 
 int main(int argc, char **argv)
 {
@@ -55,7 +61,11 @@ int main(int argc, char **argv)
 	int conv_555 = 0;
 	int gbacolors = 0;
 	int tile_width = 0, tile_height = 0;
-	int tile_dedup = 0;
+	int tile_dedup = DEDUP_NONE;
+	int tmap_format = TMAP_INDEX;
+	int tile_max = 0;
+	int num_threads = 1;
+	int stream = 0;
 	struct tilemap tmap;
 	enum dither dither = DITHER_NONE;
 
@@ -65,6 +75,12 @@ int main(int argc, char **argv)
 				switch(argv[i][1]) {
 				case 'P':
 					mode = MODE_PNG;
+					save_raw = 0;
+					break;
+
+				case 'r':
+					mode = MODE_PNG;
+					save_raw = 1;
 					break;
 
 				case 'p':
@@ -101,6 +117,47 @@ int main(int argc, char **argv)
 					text = 1;
 					break;
 
+				case 'L':
+					if(!argv[++i] || ((quant_lut_bits = atoi(argv[i])) &&
+								(quant_lut_bits < INVCMAP_MIN_BITS || quant_lut_bits > INVCMAP_MAX_BITS))) {
+						fprintf(stderr, "-L must be followed by the inverse colormap bits per channel (%d-%d), or 0\n",
+								INVCMAP_MIN_BITS, INVCMAP_MAX_BITS);
+						return 1;
+					}
+					break;
+
+				case 'N':
+					if(!argv[++i] || (quant_nearest = nearest_method_from_name(argv[i])) == -1) {
+						fprintf(stderr, "-N must be followed by the nearest color search method: brute, kdtree, or octree\n");
+						return 1;
+					}
+					break;
+
+				case 'Q':
+					if(!argv[++i] || (quant_method = quant_method_from_name(argv[i])) == -1) {
+						fprintf(stderr, "-Q must be followed by the quantizer: octree or wu\n");
+						return 1;
+					}
+					break;
+
+				case 'R':
+					if(!argv[++i] || (quant_refine = atoi(argv[i])) < 0) {
+						fprintf(stderr, "-R must be followed by the maximum number of refinement iterations\n");
+						return 1;
+					}
+					break;
+
+				case 'v':
+					verbose = 1;
+					break;
+
+				case 'j':
+					if(!argv[++i] || (num_threads = atoi(argv[i])) < 1) {
+						fprintf(stderr, "-j must be followed by the number of threads to use\n");
+						return 1;
+					}
+					break;
+
 				case 'n':
 					renibble = 1;
 					break;
@@ -118,7 +175,25 @@ int main(int argc, char **argv)
 					break;
 
 				case 'D':
-					tile_dedup = 1;
+					tile_dedup = DEDUP_EXACT;
+					/* optional tile budget */
+					if(argv[i + 1] && is_number(argv[i + 1])) {
+						if((tile_max = atoi(argv[++i])) < 1) {
+							fprintf(stderr, "-D tile budget must be at least 1\n");
+							return 1;
+						}
+					}
+					break;
+
+				case 'S':
+					stream = 1;
+					break;
+
+				case 'z':
+					if(!argv[++i] || !is_number(argv[i]) || (save_zlevel = atoi(argv[i])) > 9) {
+						fprintf(stderr, "-z must be followed by the PNG compression level (0-9)\n");
+						return 1;
+					}
 					break;
 
 				case 'o':
@@ -160,6 +235,46 @@ int main(int argc, char **argv)
 					}
 					tmap_fname = argv[i];
 
+				} else if(strcmp(argv[i], "-omf") == 0) {
+					if(!argv[++i] || (tmap_format = tilemap_format_from_name(argv[i])) == -1) {
+						fprintf(stderr, "-omf must be followed by a tilemap format: index, md, snes, or gba\n");
+						return 1;
+					}
+
+				} else if(strcmp(argv[i], "-DF") == 0) {
+					tile_dedup = DEDUP_FLIP;
+					/* optional tile budget */
+					if(argv[i + 1] && is_number(argv[i + 1])) {
+						if((tile_max = atoi(argv[++i])) < 1) {
+							fprintf(stderr, "-DF tile budget must be at least 1\n");
+							return 1;
+						}
+					}
+
+				} else if(strcmp(argv[i], "-dither") == 0) {
+					if(!argv[++i] || (int)(dither = dither_from_name(argv[i])) == -1) {
+						fprintf(stderr, "-dither must be followed by a dithering method: none, fs, atkinson, "
+								"sierra-lite, jjn, bayer2, bayer4, bayer8, or bluenoise\n");
+						return 1;
+					}
+
+				} else if(strcmp(argv[i], "-zf") == 0) {
+					if(!argv[++i] || (save_filter = save_filter_from_name(argv[i])) == -1) {
+						fprintf(stderr, "-zf must be followed by a PNG filter: none, sub, up, avg, paeth, "
+								"or adaptive\n");
+						return 1;
+					}
+
+				} else if(strcmp(argv[i], "-zs") == 0) {
+					if(!argv[++i] || (save_zstrategy = save_zstrategy_from_name(argv[i])) == -1) {
+						fprintf(stderr, "-zs must be followed by a zlib strategy: default, filtered, huffman, "
+								"rle, or fixed\n");
+						return 1;
+					}
+
+				} else if(strcmp(argv[i], "-zp") == 0) {
+					save_parallel = 1;
+
 				} else if(strcmp(argv[i], "-555") == 0) {
 					conv_555 = 1;
 
@@ -178,11 +293,68 @@ int main(int argc, char **argv)
 		fprintf(stderr, "pass the filename of a PNG file\n");
 		return 1;
 	}
+
+	if(conv_555 && mode == MODE_PNG && !save_raw) {
+		fprintf(stderr, "-555 output can't be saved as PNG, use -p or -r\n");
+		return 1;
+	}
+
+	if(tile_dedup == DEDUP_FLIP && tmap_fname && tmap_format == TMAP_INDEX) {
+		fprintf(stderr, "-DF needs a tilemap format with flip bits, pass -omf md, snes, or gba\n");
+		return 1;
+	}
+
+	if(num_threads > 1 && !(tpool = tpool_create(num_threads))) {
+		fprintf(stderr, "failed to create thread pool, continuing single-threaded\n");
+	}
+
+	if(stream) {
+		if(save_parallel) {
+			fprintf(stderr, "-zp can't be used with -S, streamed PNG output is compressed as it's written\n");
+			return 1;
+		}
+		if(!maxcol || num_infiles > 1 || slut_fname || tile_width > 0 || conv_555 || gbacolors ||
+				renibble || save_raw || (mode != MODE_PNG && mode != MODE_PIXELS)) {
+			fprintf(stderr, "-S only reduces the colors (-C) of a single image, to PNG or raw pixels\n");
+			return 1;
+		}
+		if(outfname && !(out = fopen(outfname, "wb"))) {
+			fprintf(stderr, "failed to open output file: %s: %s\n", outfname, strerror(errno));
+			return 1;
+		}
+		if(quantize_stream(infiles[0], &img, out, mode == MODE_PNG, maxcol, dither) == -1) {
+			fprintf(stderr, "failed to quantize %s\n", infiles[0]);
+			return 1;
+		}
+		if(cmap_fname) {
+			if(!(aux_out = fopen(cmap_fname, "wb"))) {
+				fprintf(stderr, "failed to open colormap output file: %s: %s\n", cmap_fname, strerror(errno));
+				return 1;
+			}
+			dump_colormap(&img, text, aux_out);
+			fclose(aux_out);
+		}
+		fclose(out);
+		tpool_destroy(tpool);
+		return 0;
+	}
+
 	if(load_image(&img, infiles[0]) == -1) {
 		fprintf(stderr, "failed to load PNG file: %s\n", infiles[0]);
 		return 1;
 	}
 
+	/* a mapped raw image reads its pixels from the file, so it has to be
+	 * copied out before opening the same file for writing truncates it
+	 */
+	if(img.mapping && (same_file(infiles[0], outfname) || same_file(infiles[0], cmap_fname) ||
+				same_file(infiles[0], slut_fname) || same_file(infiles[0], tmap_fname))) {
+		if(unmap_image(&img) == -1) {
+			fprintf(stderr, "failed to copy the pixels of %s before overwriting it\n", infiles[0]);
+			return 1;
+		}
+	}
+
 	if(gbacolors) {
 		conv_gba_image(&img);
 	}
@@ -220,7 +392,10 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
-		quantize_image(&img, maxcol, dither, shade_levels, shade_lut);
+		if(quantize_image(&img, maxcol, dither, shade_levels, shade_lut) == -1) {
+			fprintf(stderr, "failed to reduce %s to %d colors\n", infiles[0], maxcol);
+			return 1;
+		}
 
 		lutptr = shade_lut;
 		for(i=0; i<maxcol; i++) {
@@ -242,7 +417,10 @@ int main(int argc, char **argv)
 			fprintf(stderr, "requested reduction to %d colors, but image has %d colors\n", maxcol, img.cmap_ncolors);
 			return 1;
 		}
-		quantize_image(&img, maxcol, dither, 0, 0);
+		if(quantize_image(&img, maxcol, dither, 0, 0) == -1) {
+			fprintf(stderr, "failed to reduce %s to %d colors\n", infiles[0], maxcol);
+			return 1;
+		}
 	}
 
 	if(cmap_fname) {
@@ -260,15 +438,16 @@ int main(int argc, char **argv)
 
 	if(img.bpp == 4 && renibble) {
 		unsigned char *ptr = img.pixels;
-		for(i=0; i<img.width * img.height; i++) {
+		for(i=0; i<img.scansz * img.height; i++) {
 			unsigned char p = *ptr;
 			*ptr++ = (p << 4) | (p >> 4);
 		}
 	}
 
-	if(img.bpp == 16 && conv_555) {
+	if(img.bpp >= 16 && conv_555) {
 		struct image img555;
-		unsigned int rgb24[3], rgb15;
+		unsigned char *rgb24 = 0, *src;
+		uint16_t *dest;
 
 		if(alloc_image(&img555, img.width, img.height, 15) == -1) {
 			fprintf(stderr, "failed to allocate temporary %dx%d image for 555 conversion\n",
@@ -276,25 +455,43 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
+		if(img.bpp == 16 && !(rgb24 = malloc(img.width * 3))) {
+			fprintf(stderr, "failed to allocate scanline buffer for 555 conversion\n");
+			return 1;
+		}
+
 		for(i=0; i<img.height; i++) {
-			for(j=0; j<img.width; j++) {
-				get_pixel_rgb(&img, j, i, rgb24);
-				rgb15 = ((rgb24[0] >> 3) & 0x1f) | ((rgb24[1] << 2) & 0x3e0) |
-					((rgb24[2] << 7) & 0x7c00);
-				put_pixel(&img555, j, i, rgb15);
+			src = img.pixels + i * img.pitch;
+			dest = (uint16_t*)(img555.pixels + i * img555.pitch);
+
+			switch(img.bpp) {
+			case 16:
+				get_row_rgb(&img, i, 0, img.width, rgb24);
+				conv_rgb24_bgr555(rgb24, dest, img.width);
+				break;
+			case 24:
+				conv_rgb24_bgr555(src, dest, img.width);
+				break;
+			case 32:
+				conv_rgba32_bgr555(src, dest, img.width);
+				break;
+			default:
+				fprintf(stderr, "555 conversion not implemented for %d bpp\n", img.bpp);
+				return 1;
 			}
 		}
-		free(img.pixels);
+		free(rgb24);
+		free_pixels(&img);
 		img = img555;
 	}
 
 	if(tile_width > 0) {
-		if(img2tiles(tmap_fname ? &tmap : 0, &img, tile_width, tile_height, tile_dedup) == -1) {
+		if(img2tiles(tmap_fname ? &tmap : 0, &img, tile_width, tile_height, tile_dedup, tile_max) == -1) {
 			return 1;
 		}
 
-		if(tmap_fname) {
-			dump_tilemap(&tmap, tmap_fname);
+		if(tmap_fname && dump_tilemap(&tmap, tmap_fname, tmap_format) == -1) {
+			return 1;
 		}
 	}
 
@@ -307,7 +504,10 @@ int main(int argc, char **argv)
 
 	switch(mode) {
 	case MODE_PNG:
-		save_image_file(&img, out);
+		if(save_image_file(&img, out) == -1) {
+			fprintf(stderr, "failed to write output image\n");
+			return 1;
+		}
 		break;
 
 	case MODE_PIXELS:
@@ -331,6 +531,7 @@ int main(int argc, char **argv)
 	}
 
 	fclose(out);
+	tpool_destroy(tpool);
 	return 0;
 }
 
@@ -470,16 +671,49 @@ void print_usage(const char *argv0)
 	printf(" -os <lut file>: generate and output shading LUT\n");
 	printf(" -p: dump pixels (default)\n");
 	printf(" -P: output in PNG format\n");
+	printf(" -r: output in imgquant's raw image format, which loads without decoding\n");
 	printf(" -c: dump colormap (palette) entries\n");
 	printf(" -C <colors>: reduce image down to specified number of colors\n");
+	printf(" -d: Floyd-Steinberg dithering, same as -dither fs\n");
+	printf(" -dither <method>: dithering for color reduction: none, fs, atkinson,\n");
+	printf("    sierra-lite, jjn, bayer2, bayer4, bayer8, or bluenoise. Error diffusion\n");
+	printf("    methods take a -serp suffix for serpentine scanning (fs-serp, jjn-serp...).\n");
+	printf("    bayer/bluenoise: ordered, tile-stable dithering\n");
 	printf(" -s <shade levels>: used in conjunction with -os (default: 8)\n");
+	printf(" -L <bits>: inverse colormap precision for remapping, 0 to disable (default: 5)\n");
+	printf(" -Q <quantizer>: palette generation method: octree or wu (default: octree)\n");
+	printf(" -R <iterations>: refine the palette with up to this many k-means iterations\n");
+	printf(" -N <method>: nearest color search: brute, kdtree, or octree (default: brute)\n");
 	printf(" -i: print image information\n");
 	printf(" -t: output as text when possible\n");
 	printf(" -n: swap the order of nibbles (for 4bpp)\n");
-	printf(" -555: convert to BGR555\n");
+	printf(" -555: convert 16bpp (RGB565) or truecolor images to BGR555\n");
 	printf(" -g: GBA colors (optimize colors for the GBA display)\n");
 	printf(" -T <WxH>: reorder as a series of tiles of the requested size\n");
-	printf(" -D: deduplicate tiles\n");
+	printf(" -D [max tiles]: deduplicate tiles, and if there are more than max tiles left,\n");
+	printf("    merge the most similar ones until there aren't\n");
+	printf(" -DF [max tiles]: same as -D, also matching horizontally and vertically\n");
+	printf("    flipped copies of tiles\n");
+	printf(" -S: stream the image strip by strip instead of loading it, for color\n");
+	printf("    reduction (-C) of huge images. Reads the input file twice.\n");
 	printf(" -om <tilemap file>: output tilemap recreating the image from dedup-ed tiles\n");
+	printf(" -omf <format>: tilemap entry format: index (default, no flip bits), md, snes,\n");
+	printf("    or gba\n");
+	printf(" -z <level>: PNG compression level, 0-9\n");
+	printf(" -zf <filter>: PNG scanline filter: none, sub, up, avg, paeth, or adaptive\n");
+	printf(" -zs <strategy>: zlib strategy: default, filtered, huffman, rle, or fixed\n");
+	printf(" -zp: compress PNG output in parallel blocks on the -j threads (not with -S)\n");
+	printf(" -j <threads>: number of worker threads to use (default: 1)\n");
+	printf(" -v: verbose output, print timings\n");
 	printf(" -h: print usage and exit\n");
 }
+
+int is_number(const char *s)
+{
+	if(!*s) return 0;
+	while(*s) {
+		if(*s < '0' || *s > '9') return 0;
+		s++;
+	}
+	return 1;
+}
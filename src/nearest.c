@@ -0,0 +1,323 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include "nearest.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NEAREST_X86
+#include <immintrin.h>
+#endif
+
+/* padding entries are placed far enough to never win */
+#define FAR_AWAY	1e6f
+
+static int brute_scalar(struct nearest *nn, int r, int g, int b);
+#ifdef NEAREST_X86
+static int brute_sse2(struct nearest *nn, int r, int g, int b);
+static int brute_avx(struct nearest *nn, int r, int g, int b);
+#endif
+static int build_kdtree(struct nearest *nn, int *idx, int count, int *nextnode);
+static void kd_search(struct nearest *nn, int node, const int *pt, int *best, int *bestdist);
+
+static const char *method_names[] = {"brute", "kdtree", "octree"};
+
+int init_nearest(struct nearest *nn, enum nearest_method method, struct cmapent *cmap, int ncolors)
+{
+	int i, idx[256], nextnode;
+
+	if(ncolors < 1 || ncolors > 256) {
+		return -1;
+	}
+
+	nn->method = method;
+	nn->ncolors = ncolors;
+	memcpy(nn->cmap, cmap, ncolors * sizeof *cmap);
+
+	nn->npad = (ncolors + 7) & ~7;
+	for(i=0; i<nn->npad; i++) {
+		if(i < ncolors) {
+			nn->pr[i] = cmap[i].r;
+			nn->pg[i] = cmap[i].g;
+			nn->pb[i] = cmap[i].b;
+		} else {
+			nn->pr[i] = nn->pg[i] = nn->pb[i] = FAR_AWAY;
+		}
+	}
+
+	nn->brute = brute_scalar;
+#ifdef NEAREST_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx")) {
+		nn->brute = brute_avx;
+	} else if(__builtin_cpu_supports("sse2")) {
+		nn->brute = brute_sse2;
+	}
+#endif
+
+	if(method == NEAREST_KDTREE) {
+		for(i=0; i<ncolors; i++) {
+			idx[i] = i;
+		}
+		nextnode = 0;
+		nn->kdroot = build_kdtree(nn, idx, ncolors, &nextnode);
+	}
+	return 0;
+}
+
+int nearest_color(struct nearest *nn, int r, int g, int b)
+{
+	int pt[3], best, bestdist;
+
+	if(nn->method == NEAREST_KDTREE) {
+		pt[0] = r;
+		pt[1] = g;
+		pt[2] = b;
+		best = 0;
+		bestdist = INT_MAX;
+		kd_search(nn, nn->kdroot, pt, &best, &bestdist);
+		return best;
+	}
+	return nn->brute(nn, r, g, b);
+}
+
+const char *nearest_method_name(enum nearest_method method)
+{
+	return method_names[method];
+}
+
+int nearest_method_from_name(const char *name)
+{
+	int i;
+
+	for(i=0; i<sizeof method_names / sizeof *method_names; i++) {
+		if(strcmp(name, method_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int brute_scalar(struct nearest *nn, int r, int g, int b)
+{
+	int i, dr, dg, db, dist, best = 0, bestdist = INT_MAX;
+
+	for(i=0; i<nn->ncolors; i++) {
+		dr = nn->cmap[i].r - r;
+		dg = nn->cmap[i].g - g;
+		db = nn->cmap[i].b - b;
+		dist = dr * dr + dg * dg + db * db;
+		if(dist < bestdist) {
+			bestdist = dist;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* The SIMD kernels compute distances in floats, which is exact for squared
+ * 8bit differences. Each lane keeps the first minimum it sees, so picking the
+ * lowest index among the lanes with the minimum distance at the end matches
+ * the scalar loop.
+ */
+#ifdef NEAREST_X86
+static int reduce_lanes(float *dist, float *idx, int nlanes)
+{
+	int i, best = 0;
+
+	for(i=1; i<nlanes; i++) {
+		if(dist[i] < dist[best] || (dist[i] == dist[best] && idx[i] < idx[best])) {
+			best = i;
+		}
+	}
+	return (int)idx[best];
+}
+
+__attribute__((target("sse2")))
+static int brute_sse2(struct nearest *nn, int r, int g, int b)
+{
+	int i;
+	__m128 vr, vg, vb, dr, dg, db, dist, mask, best, bestidx, idx, four;
+	float dbuf[4], ibuf[4];
+
+	vr = _mm_set1_ps(r);
+	vg = _mm_set1_ps(g);
+	vb = _mm_set1_ps(b);
+	best = _mm_set1_ps(FLT_MAX);
+	bestidx = _mm_setzero_ps();
+	idx = _mm_setr_ps(0, 1, 2, 3);
+	four = _mm_set1_ps(4);
+
+	for(i=0; i<nn->npad; i+=4) {
+		dr = _mm_sub_ps(_mm_loadu_ps(nn->pr + i), vr);
+		dg = _mm_sub_ps(_mm_loadu_ps(nn->pg + i), vg);
+		db = _mm_sub_ps(_mm_loadu_ps(nn->pb + i), vb);
+		dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+		mask = _mm_cmplt_ps(dist, best);
+		best = _mm_min_ps(dist, best);
+		bestidx = _mm_or_ps(_mm_and_ps(mask, idx), _mm_andnot_ps(mask, bestidx));
+		idx = _mm_add_ps(idx, four);
+	}
+
+	_mm_storeu_ps(dbuf, best);
+	_mm_storeu_ps(ibuf, bestidx);
+	return reduce_lanes(dbuf, ibuf, 4);
+}
+
+__attribute__((target("avx")))
+static int brute_avx(struct nearest *nn, int r, int g, int b)
+{
+	int i;
+	__m256 vr, vg, vb, dr, dg, db, dist, mask, best, bestidx, idx, eight;
+	float dbuf[8], ibuf[8];
+
+	vr = _mm256_set1_ps(r);
+	vg = _mm256_set1_ps(g);
+	vb = _mm256_set1_ps(b);
+	best = _mm256_set1_ps(FLT_MAX);
+	bestidx = _mm256_setzero_ps();
+	idx = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	eight = _mm256_set1_ps(8);
+
+	for(i=0; i<nn->npad; i+=8) {
+		dr = _mm256_sub_ps(_mm256_loadu_ps(nn->pr + i), vr);
+		dg = _mm256_sub_ps(_mm256_loadu_ps(nn->pg + i), vg);
+		db = _mm256_sub_ps(_mm256_loadu_ps(nn->pb + i), vb);
+		dist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)),
+				_mm256_mul_ps(db, db));
+
+		mask = _mm256_cmp_ps(dist, best, _CMP_LT_OQ);
+		best = _mm256_min_ps(dist, best);
+		bestidx = _mm256_blendv_ps(bestidx, idx, mask);
+		idx = _mm256_add_ps(idx, eight);
+	}
+
+	_mm256_storeu_ps(dbuf, best);
+	_mm256_storeu_ps(ibuf, bestidx);
+	return reduce_lanes(dbuf, ibuf, 8);
+}
+#endif	/* NEAREST_X86 */
+
+
+static int kd_coord(struct nearest *nn, int idx, int axis)
+{
+	switch(axis) {
+	case 0:
+		return nn->cmap[idx].r;
+	case 1:
+		return nn->cmap[idx].g;
+	default:
+		break;
+	}
+	return nn->cmap[idx].b;
+}
+
+/* insertion sort by coordinate, palettes are small */
+static void sort_axis(struct nearest *nn, int *idx, int count, int axis)
+{
+	int i, j, tmp, c;
+
+	for(i=1; i<count; i++) {
+		tmp = idx[i];
+		c = kd_coord(nn, tmp, axis);
+		for(j=i; j>0 && kd_coord(nn, idx[j - 1], axis) > c; j--) {
+			idx[j] = idx[j - 1];
+		}
+		idx[j] = tmp;
+	}
+}
+
+/* splits on the median of the axis with the largest extent, and returns the
+ * index of the new node. Nodes are allocated in pre-order from *nextnode.
+ */
+static int build_kdtree(struct nearest *nn, int *idx, int count, int *nextnode)
+{
+	int i, j, c, mid, axis, node, ext, maxext = -1;
+	int lo[3], hi[3];
+	struct kdnode *kn;
+
+	if(count <= 0) return -1;
+
+	for(j=0; j<3; j++) {
+		lo[j] = INT_MAX;
+		hi[j] = INT_MIN;
+	}
+	for(i=0; i<count; i++) {
+		for(j=0; j<3; j++) {
+			c = kd_coord(nn, idx[i], j);
+			if(c < lo[j]) lo[j] = c;
+			if(c > hi[j]) hi[j] = c;
+		}
+	}
+	axis = 0;
+	for(j=0; j<3; j++) {
+		ext = hi[j] - lo[j];
+		if(ext > maxext) {
+			maxext = ext;
+			axis = j;
+		}
+	}
+
+	sort_axis(nn, idx, count, axis);
+
+	mid = count / 2;
+	node = (*nextnode)++;
+	kn = nn->kd + node;
+	kn->idx = idx[mid];
+	kn->axis = axis;
+	kn->left = build_kdtree(nn, idx, mid, nextnode);
+	kn->right = build_kdtree(nn, idx + mid + 1, count - mid - 1, nextnode);
+	return node;
+}
+
+static void kd_search(struct nearest *nn, int node, const int *pt, int *best, int *bestdist)
+{
+	int dr, dg, db, dist, diff, near, far;
+	struct kdnode *kn;
+
+	if(node < 0) return;
+	kn = nn->kd + node;
+
+	dr = nn->cmap[kn->idx].r - pt[0];
+	dg = nn->cmap[kn->idx].g - pt[1];
+	db = nn->cmap[kn->idx].b - pt[2];
+	dist = dr * dr + dg * dg + db * db;
+	if(dist < *bestdist || (dist == *bestdist && kn->idx < *best)) {
+		*bestdist = dist;
+		*best = kn->idx;
+	}
+
+	diff = pt[kn->axis] - kd_coord(nn, kn->idx, kn->axis);
+	if(diff < 0) {
+		near = kn->left;
+		far = kn->right;
+	} else {
+		near = kn->right;
+		far = kn->left;
+	}
+
+	kd_search(nn, near, pt, best, bestdist);
+	/* <= to still find a lower index at the same distance on the far side */
+	if(diff * diff <= *bestdist) {
+		kd_search(nn, far, pt, best, bestdist);
+	}
+}
@@ -0,0 +1,61 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef NEAREST_H_
+#define NEAREST_H_
+
+#include "image.h"
+
+enum nearest_method {
+	NEAREST_BRUTE,		/* SIMD distance kernel over the whole palette */
+	NEAREST_KDTREE,
+	NEAREST_OCTREE		/* quantizer octree walk, approximate */
+};
+
+struct kdnode {
+	int idx, axis;
+	int left, right;
+};
+
+/* nearest palette color search. All exact methods return the lowest palette
+ * index among equally distant entries.
+ */
+struct nearest {
+	enum nearest_method method;
+	int ncolors, npad;
+	struct cmapent cmap[256];
+
+	/* palette in structure-of-arrays form, padded for the SIMD kernels */
+	float pr[256], pg[256], pb[256];
+
+	struct kdnode kd[256];
+	int kdroot;
+
+	int (*brute)(struct nearest *nn, int r, int g, int b);
+};
+
+/* for NEAREST_OCTREE the caller does the walk, the palette is set up for brute
+ * force search, to handle palettes which didn't come from an octree
+ */
+int init_nearest(struct nearest *nn, enum nearest_method method, struct cmapent *cmap, int ncolors);
+
+int nearest_color(struct nearest *nn, int r, int g, int b);
+
+const char *nearest_method_name(enum nearest_method method);
+int nearest_method_from_name(const char *name);
+
+#endif	/* NEAREST_H_ */
@@ -0,0 +1,417 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "pixconv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXCONV_X86
+#include <immintrin.h>
+#endif
+
+#define EXPAND5(x)	(((x) << 3) | ((x) >> 2))
+#define EXPAND6(x)	(((x) << 2) | ((x) >> 4))
+
+static void rgb24_bgr555_scalar(const unsigned char *src, uint16_t *dest, int n, int stride)
+{
+	int i;
+
+	for(i=0; i<n; i++) {
+		dest[i] = (src[0] >> 3) | ((src[1] >> 3) << 5) | ((src[2] >> 3) << 10);
+		src += stride;
+	}
+}
+
+static void rgb565_rgb24_scalar(const uint16_t *src, unsigned char *dest, int n)
+{
+	int i;
+	unsigned int pix, r, g, b;
+
+	for(i=0; i<n; i++) {
+		pix = src[i];
+		r = pix >> 11;
+		g = (pix >> 5) & 0x3f;
+		b = pix & 0x1f;
+		*dest++ = EXPAND5(r);
+		*dest++ = EXPAND6(g);
+		*dest++ = EXPAND5(b);
+	}
+}
+
+static void bgr555_rgb24_scalar(const uint16_t *src, unsigned char *dest, int n)
+{
+	int i;
+	unsigned int pix, r, g, b;
+
+	for(i=0; i<n; i++) {
+		pix = src[i];
+		r = pix & 0x1f;
+		g = (pix >> 5) & 0x1f;
+		b = (pix >> 10) & 0x1f;
+		*dest++ = EXPAND5(r);
+		*dest++ = EXPAND5(g);
+		*dest++ = EXPAND5(b);
+	}
+}
+
+/* The SIMD kernels handle whole groups of pixels and leave the rest to the
+ * scalar code. Some of them read or write a few bytes past the group they're
+ * working on, so they stop early enough to stay within the scanline.
+ */
+#ifdef PIXCONV_X86
+static uint32_t load32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+/* RGBX in 32bit lanes to BGR555 */
+__attribute__((target("sse2")))
+static __m128i pack555_sse2(__m128i v)
+{
+	__m128i r = _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf8)), 3);
+	__m128i g = _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf800)), 6);
+	__m128i b = _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf80000)), 9);
+	return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+__attribute__((target("sse2")))
+static int rgb24_bgr555_sse2(const unsigned char *src, uint16_t *dest, int n)
+{
+	int i;
+	__m128i a, b;
+
+	/* the last 32bit load of each group reads one byte past it */
+	for(i=0; i+9<=n; i+=8) {
+		a = _mm_setr_epi32(load32(src), load32(src + 3), load32(src + 6), load32(src + 9));
+		b = _mm_setr_epi32(load32(src + 12), load32(src + 15), load32(src + 18), load32(src + 21));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_packs_epi32(pack555_sse2(a), pack555_sse2(b)));
+		src += 24;
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+static int rgba32_bgr555_sse2(const unsigned char *src, uint16_t *dest, int n)
+{
+	int i;
+	__m128i a, b;
+
+	for(i=0; i+8<=n; i+=8) {
+		a = _mm_loadu_si128((const __m128i*)src);
+		b = _mm_loadu_si128((const __m128i*)(src + 16));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_packs_epi32(pack555_sse2(a), pack555_sse2(b)));
+		src += 32;
+	}
+	return i;
+}
+
+/* 8bit channels in 16bit lanes to RGB24, through RGBX in 32bit lanes */
+__attribute__((target("sse2")))
+static void store_rgb24_sse2(__m128i r, __m128i g, __m128i b, unsigned char *dest)
+{
+	int i;
+	uint32_t rgbx[8];
+	__m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+
+	_mm_storeu_si128((__m128i*)rgbx, _mm_unpacklo_epi16(rg, b));
+	_mm_storeu_si128((__m128i*)(rgbx + 4), _mm_unpackhi_epi16(rg, b));
+	for(i=0; i<8; i++) {
+		*dest++ = rgbx[i];
+		*dest++ = rgbx[i] >> 8;
+		*dest++ = rgbx[i] >> 16;
+	}
+}
+
+__attribute__((target("sse2")))
+static __m128i expand5_sse2(__m128i x)
+{
+	return _mm_or_si128(_mm_slli_epi16(x, 3), _mm_srli_epi16(x, 2));
+}
+
+__attribute__((target("sse2")))
+static int rgb565_rgb24_sse2(const uint16_t *src, unsigned char *dest, int n)
+{
+	int i;
+	__m128i pix, r, g, b;
+	__m128i mask5 = _mm_set1_epi16(0x1f), mask6 = _mm_set1_epi16(0x3f);
+
+	for(i=0; i+8<=n; i+=8) {
+		pix = _mm_loadu_si128((const __m128i*)(src + i));
+		r = expand5_sse2(_mm_srli_epi16(pix, 11));
+		g = _mm_and_si128(_mm_srli_epi16(pix, 5), mask6);
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = expand5_sse2(_mm_and_si128(pix, mask5));
+		store_rgb24_sse2(r, g, b, dest + i * 3);
+	}
+	return i;
+}
+
+__attribute__((target("sse2")))
+static int bgr555_rgb24_sse2(const uint16_t *src, unsigned char *dest, int n)
+{
+	int i;
+	__m128i pix, r, g, b;
+	__m128i mask5 = _mm_set1_epi16(0x1f);
+
+	for(i=0; i+8<=n; i+=8) {
+		pix = _mm_loadu_si128((const __m128i*)(src + i));
+		r = expand5_sse2(_mm_and_si128(pix, mask5));
+		g = expand5_sse2(_mm_and_si128(_mm_srli_epi16(pix, 5), mask5));
+		b = expand5_sse2(_mm_and_si128(_mm_srli_epi16(pix, 10), mask5));
+		store_rgb24_sse2(r, g, b, dest + i * 3);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i pack555_avx2(__m256i v)
+{
+	__m256i r = _mm256_srli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0xf8)), 3);
+	__m256i g = _mm256_srli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0xf800)), 6);
+	__m256i b = _mm256_srli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0xf80000)), 9);
+	return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+/* 8 BGR555 pixels from two 8 pixel vectors packed per lane */
+__attribute__((target("avx2")))
+static void store555_avx2(__m256i a, __m256i b, uint16_t *dest)
+{
+	__m256i res = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+	_mm256_storeu_si256((__m256i*)dest, res);
+}
+
+__attribute__((target("avx2")))
+static int rgb24_bgr555_avx2(const unsigned char *src, uint16_t *dest, int n)
+{
+	int i;
+	__m256i a, b;
+	/* 12 bytes of RGB per lane, then RGBX in each 32bit element */
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+	const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+	/* each 32 byte load covers 8 pixels and reads 8 bytes past them */
+	for(i=0; i+19<=n; i+=16) {
+		a = _mm256_loadu_si256((const __m256i*)src);
+		b = _mm256_loadu_si256((const __m256i*)(src + 24));
+		a = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(a, perm), shuf);
+		b = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(b, perm), shuf);
+		store555_avx2(pack555_avx2(a), pack555_avx2(b), dest + i);
+		src += 48;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int rgba32_bgr555_avx2(const unsigned char *src, uint16_t *dest, int n)
+{
+	int i;
+	__m256i a, b;
+
+	for(i=0; i+16<=n; i+=16) {
+		a = _mm256_loadu_si256((const __m256i*)src);
+		b = _mm256_loadu_si256((const __m256i*)(src + 32));
+		store555_avx2(pack555_avx2(a), pack555_avx2(b), dest + i);
+		src += 64;
+	}
+	return i;
+}
+
+/* 16 pixels of 8bit channels in 16bit lanes to RGB24. Each 16 byte store
+ * writes 4 bytes of garbage after its 4 pixels, which the next store or the
+ * next group overwrites.
+ */
+__attribute__((target("avx2")))
+static void store_rgb24_avx2(__m256i r, __m256i g, __m256i b, unsigned char *dest)
+{
+	__m256i rg, lo, hi;
+	const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+	/* unpacking works within lanes: lo has pixels 0-3 and 8-11, hi 4-7 and 12-15 */
+	lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(rg, b), shuf);
+	hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(rg, b), shuf);
+
+	_mm_storeu_si128((__m128i*)dest, _mm256_castsi256_si128(lo));
+	_mm_storeu_si128((__m128i*)(dest + 12), _mm256_castsi256_si128(hi));
+	_mm_storeu_si128((__m128i*)(dest + 24), _mm256_extracti128_si256(lo, 1));
+	_mm_storeu_si128((__m128i*)(dest + 36), _mm256_extracti128_si256(hi, 1));
+}
+
+__attribute__((target("avx2")))
+static __m256i expand5_avx2(__m256i x)
+{
+	return _mm256_or_si256(_mm256_slli_epi16(x, 3), _mm256_srli_epi16(x, 2));
+}
+
+__attribute__((target("avx2")))
+static int rgb565_rgb24_avx2(const uint16_t *src, unsigned char *dest, int n)
+{
+	int i;
+	__m256i pix, r, g, b;
+	__m256i mask5 = _mm256_set1_epi16(0x1f), mask6 = _mm256_set1_epi16(0x3f);
+
+	for(i=0; i+18<=n; i+=16) {
+		pix = _mm256_loadu_si256((const __m256i*)(src + i));
+		r = expand5_avx2(_mm256_srli_epi16(pix, 11));
+		g = _mm256_and_si256(_mm256_srli_epi16(pix, 5), mask6);
+		g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+		b = expand5_avx2(_mm256_and_si256(pix, mask5));
+		store_rgb24_avx2(r, g, b, dest + i * 3);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int bgr555_rgb24_avx2(const uint16_t *src, unsigned char *dest, int n)
+{
+	int i;
+	__m256i pix, r, g, b;
+	__m256i mask5 = _mm256_set1_epi16(0x1f);
+
+	for(i=0; i+18<=n; i+=16) {
+		pix = _mm256_loadu_si256((const __m256i*)(src + i));
+		r = expand5_avx2(_mm256_and_si256(pix, mask5));
+		g = expand5_avx2(_mm256_and_si256(_mm256_srli_epi16(pix, 5), mask5));
+		b = expand5_avx2(_mm256_and_si256(_mm256_srli_epi16(pix, 10), mask5));
+		store_rgb24_avx2(r, g, b, dest + i * 3);
+	}
+	return i;
+}
+#endif	/* PIXCONV_X86 */
+
+static int isa_override = PIXCONV_AUTO;
+
+static int isa_supported(int isa)
+{
+	switch(isa) {
+	case PIXCONV_AUTO:
+	case PIXCONV_SCALAR:
+		return 1;
+#ifdef PIXCONV_X86
+	case PIXCONV_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case PIXCONV_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		break;
+	}
+	return 0;
+}
+
+int pixconv_set_isa(int isa)
+{
+	if(!isa_supported(isa)) {
+		return -1;
+	}
+	isa_override = isa;
+	return 0;
+}
+
+static int cur_isa(void)
+{
+	if(isa_override != PIXCONV_AUTO) {
+		return isa_override;
+	}
+	if(isa_supported(PIXCONV_AVX2)) {
+		return PIXCONV_AVX2;
+	}
+	if(isa_supported(PIXCONV_SSE2)) {
+		return PIXCONV_SSE2;
+	}
+	return PIXCONV_SCALAR;
+}
+
+void conv_rgb24_bgr555(const unsigned char *src, uint16_t *dest, int n)
+{
+	int done = 0;
+
+#ifdef PIXCONV_X86
+	switch(cur_isa()) {
+	case PIXCONV_AVX2:
+		done = rgb24_bgr555_avx2(src, dest, n);
+		break;
+	case PIXCONV_SSE2:
+		done = rgb24_bgr555_sse2(src, dest, n);
+		break;
+	default:
+		break;
+	}
+#endif
+	rgb24_bgr555_scalar(src + done * 3, dest + done, n - done, 3);
+}
+
+void conv_rgba32_bgr555(const unsigned char *src, uint16_t *dest, int n)
+{
+	int done = 0;
+
+#ifdef PIXCONV_X86
+	switch(cur_isa()) {
+	case PIXCONV_AVX2:
+		done = rgba32_bgr555_avx2(src, dest, n);
+		break;
+	case PIXCONV_SSE2:
+		done = rgba32_bgr555_sse2(src, dest, n);
+		break;
+	default:
+		break;
+	}
+#endif
+	rgb24_bgr555_scalar(src + done * 4, dest + done, n - done, 4);
+}
+
+void conv_rgb565_rgb24(const uint16_t *src, unsigned char *dest, int n)
+{
+	int done = 0;
+
+#ifdef PIXCONV_X86
+	switch(cur_isa()) {
+	case PIXCONV_AVX2:
+		done = rgb565_rgb24_avx2(src, dest, n);
+		break;
+	case PIXCONV_SSE2:
+		done = rgb565_rgb24_sse2(src, dest, n);
+		break;
+	default:
+		break;
+	}
+#endif
+	rgb565_rgb24_scalar(src + done, dest + done * 3, n - done);
+}
+
+void conv_bgr555_rgb24(const uint16_t *src, unsigned char *dest, int n)
+{
+	int done = 0;
+
+#ifdef PIXCONV_X86
+	switch(cur_isa()) {
+	case PIXCONV_AVX2:
+		done = bgr555_rgb24_avx2(src, dest, n);
+		break;
+	case PIXCONV_SSE2:
+		done = bgr555_rgb24_sse2(src, dest, n);
+		break;
+	default:
+		break;
+	}
+#endif
+	bgr555_rgb24_scalar(src + done, dest + done * 3, n - done);
+}
@@ -0,0 +1,47 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef PIXCONV_H_
+#define PIXCONV_H_
+
+#include <stdint.h>
+
+/* scanline pixel format conversions, n pixels each. Picks SSE2 or AVX2 code
+ * at runtime where available, with identical results to the scalar code.
+ * Expanding 5 or 6 bit channels to 8 bits replicates their top bits into the
+ * low bits, so that 0 maps to 0 and the maximum to 255.
+ * BGR555 has red in the low bits, RGB565 has red in the high bits.
+ */
+enum {
+	PIXCONV_AUTO,
+	PIXCONV_SCALAR,
+	PIXCONV_SSE2,
+	PIXCONV_AVX2
+};
+
+/* forces the conversions to use one code path instead of the best one the CPU
+ * supports, which lets the test compare them on the same machine. Returns -1
+ * if the CPU can't run the requested code path.
+ */
+int pixconv_set_isa(int isa);
+
+void conv_rgb24_bgr555(const unsigned char *src, uint16_t *dest, int n);
+void conv_rgba32_bgr555(const unsigned char *src, uint16_t *dest, int n);
+void conv_rgb565_rgb24(const uint16_t *src, unsigned char *dest, int n);
+void conv_bgr555_rgb24(const uint16_t *src, unsigned char *dest, int n);
+
+#endif	/* PIXCONV_H_ */
@@ -0,0 +1,374 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "pngenc.h"
+#include "tpool.h"
+
+/* uncompressed bytes per deflate block, rounded to whole scanlines */
+#define BLOCK_SIZE	131072
+/* each block is primed with this much of the data preceding it, so splitting
+ * costs very little compression
+ */
+#define DICT_SIZE	32768
+/* adaptive filtering drops a filter if it's worse after this many bytes */
+#define FILTER_SPAN	256
+
+struct deflate_block {
+	unsigned char *out;
+	unsigned long outsz;
+	unsigned long insz;
+	uLong adler;
+};
+
+struct encode_job {
+	struct image *img;
+	int filter, level, strategy;
+	int pixsz;		/* bytes per complete pixel, at least 1 */
+	int rowsz;		/* filter type byte, followed by the scanline */
+	int blkrows, nblocks;
+	unsigned char *filtered;
+	struct deflate_block *blk;
+	int failed;
+};
+
+/* the paeth predictor, with the distances computed relative to c */
+static inline int paeth(int a, int b, int c)
+{
+	int pa = b - c;
+	int pb = a - c;
+	int pc = pa + pb;
+
+	pa = pa < 0 ? -pa : pa;
+	pb = pb < 0 ? -pb : pb;
+	pc = pc < 0 ? -pc : pc;
+
+	if(pa <= pb && pa <= pc) return a;
+	return pb <= pc ? b : c;
+}
+
+/* applies one filter to bytes [start, end) of a scanline. prev is the previous
+ * unfiltered scanline, or null for the first one. The first pixel has no left
+ * neighbour and is handled on its own, to keep the main loops simple.
+ */
+static void filter_span(int type, unsigned char *dest, const unsigned char *row,
+		const unsigned char *prev, int start, int end, int pixsz)
+{
+	int i;
+	static const unsigned char zero[8];
+
+	if(!prev) {
+		/* with a row of zeros above: up is none, and paeth always picks the
+		 * left pixel, which makes it sub
+		 */
+		prev = zero;
+		if(type == FILTER_UP) type = FILTER_NONE;
+		if(type == FILTER_PAETH) type = FILTER_SUB;
+	}
+
+	for(i=start; i<end && i<pixsz; i++) {
+		switch(type) {
+		case FILTER_UP:
+		case FILTER_PAETH:
+			dest[i] = row[i] - prev[i];
+			break;
+		case FILTER_AVG:
+			dest[i] = row[i] - (prev == zero ? 0 : prev[i] >> 1);
+			break;
+		default:
+			dest[i] = row[i];
+		}
+	}
+	start = i;
+
+	switch(type) {
+	case FILTER_SUB:
+		for(i=start; i<end; i++) {
+			dest[i] = row[i] - row[i - pixsz];
+		}
+		break;
+
+	case FILTER_UP:
+		for(i=start; i<end; i++) {
+			dest[i] = row[i] - prev[i];
+		}
+		break;
+
+	case FILTER_AVG:
+		if(prev == zero) {
+			for(i=start; i<end; i++) {
+				dest[i] = row[i] - (row[i - pixsz] >> 1);
+			}
+		} else {
+			for(i=start; i<end; i++) {
+				dest[i] = row[i] - ((row[i - pixsz] + prev[i]) >> 1);
+			}
+		}
+		break;
+
+	case FILTER_PAETH:
+		for(i=start; i<end; i++) {
+			dest[i] = row[i] - paeth(row[i - pixsz], prev[i], prev[i - pixsz]);
+		}
+		break;
+
+	default:
+		memcpy(dest + start, row + start, end - start);
+	}
+}
+
+/* sum of the filtered bytes taken as signed, the usual adaptive heuristic */
+static unsigned long filter_cost(const unsigned char *buf, int len)
+{
+	int i;
+	unsigned long sum = 0;
+
+	for(i=0; i<len; i++) {
+		sum += abs((signed char)buf[i]);
+	}
+	return sum;
+}
+
+/* Filters a scanline with each filter in turn, and keeps the first with the
+ * lowest cost. Filtering proceeds in short spans, so that a filter is dropped
+ * as soon as it costs more than the best so far. buf is scratch space for two
+ * scanlines. Returns the filter type.
+ */
+static int filter_adaptive(unsigned char *out, unsigned char *buf, const unsigned char *row,
+		const unsigned char *prev, int len, int pixsz)
+{
+	int i, n, type, best = FILTER_NONE;
+	unsigned long cost, mincost;
+	unsigned char *tmp, *dest = buf, *trial = buf + len;
+
+	filter_span(FILTER_NONE, dest, row, prev, 0, len, pixsz);
+	mincost = filter_cost(dest, len);
+
+	for(type=FILTER_SUB; type<=FILTER_PAETH; type++) {
+		cost = 0;
+		for(i=0; i<len && cost < mincost; i+=FILTER_SPAN) {
+			n = len - i < FILTER_SPAN ? len - i : FILTER_SPAN;
+			filter_span(type, trial, row, prev, i, i + n, pixsz);
+			cost += filter_cost(trial + i, n);
+		}
+		if(cost < mincost) {
+			mincost = cost;
+			best = type;
+			tmp = dest;
+			dest = trial;
+			trial = tmp;
+		}
+	}
+	memcpy(out, dest, len);
+	return best;
+}
+
+static void filter_block(void *cls, int job)
+{
+	int i, y0, y1;
+	struct encode_job *ej = cls;
+	struct image *img = ej->img;
+	unsigned char *row, *prev, *dest, *buf = 0;
+
+	y0 = job * ej->blkrows;
+	y1 = y0 + ej->blkrows < img->height ? y0 + ej->blkrows : img->height;
+
+	if(ej->filter == FILTER_ADAPTIVE && !(buf = malloc(img->scansz * 2))) {
+		ej->failed = 1;
+		return;
+	}
+
+	for(i=y0; i<y1; i++) {
+		row = img->pixels + i * img->pitch;
+		prev = i > 0 ? row - img->pitch : 0;
+		dest = ej->filtered + i * ej->rowsz;
+
+		if(ej->filter != FILTER_ADAPTIVE) {
+			dest[0] = ej->filter;
+			filter_span(ej->filter, dest + 1, row, prev, 0, img->scansz, ej->pixsz);
+			continue;
+		}
+
+		dest[0] = filter_adaptive(dest + 1, buf, row, prev, img->scansz, ej->pixsz);
+	}
+	free(buf);
+}
+
+/* Raw deflate of one block. Every block but the last ends with a sync flush,
+ * which ends on a byte boundary, so the compressed blocks can be concatenated
+ * into one deflate stream, the way pigz does it.
+ */
+static void deflate_block(void *cls, int job)
+{
+	int res, last;
+	unsigned long offs, dictsz, bufsz;
+	unsigned char *tmp;
+	z_stream zs;
+	struct encode_job *ej = cls;
+	struct deflate_block *blk = ej->blk + job;
+
+	last = job == ej->nblocks - 1;
+	offs = (unsigned long)job * ej->blkrows * ej->rowsz;
+	blk->insz = last ? (unsigned long)ej->img->height * ej->rowsz - offs :
+		(unsigned long)ej->blkrows * ej->rowsz;
+	blk->adler = adler32(1, ej->filtered + offs, blk->insz);
+	blk->out = 0;
+
+	memset(&zs, 0, sizeof zs);
+	if(deflateInit2(&zs, ej->level, Z_DEFLATED, -15, 8, ej->strategy) != Z_OK) {
+		ej->failed = 1;
+		return;
+	}
+	if(job > 0) {
+		dictsz = offs < DICT_SIZE ? offs : DICT_SIZE;
+		deflateSetDictionary(&zs, ej->filtered + offs - dictsz, dictsz);
+	}
+
+	bufsz = deflateBound(&zs, blk->insz) + 16;
+	if(!(blk->out = malloc(bufsz))) {
+		deflateEnd(&zs);
+		ej->failed = 1;
+		return;
+	}
+	zs.next_in = ej->filtered + offs;
+	zs.avail_in = blk->insz;
+	zs.next_out = blk->out;
+	zs.avail_out = bufsz;
+
+	for(;;) {
+		res = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+		if(res == Z_STREAM_ERROR) {
+			ej->failed = 1;
+			break;
+		}
+		/* done when the stream ends, or the flush fits with room to spare */
+		if(res == Z_STREAM_END || (!last && zs.avail_out > 0)) {
+			break;
+		}
+		if(!(tmp = realloc(blk->out, bufsz * 2))) {
+			ej->failed = 1;
+			break;
+		}
+		blk->out = tmp;
+		zs.next_out = blk->out + bufsz;
+		zs.avail_out = bufsz;
+		bufsz *= 2;
+	}
+	blk->outsz = zs.total_out;
+	deflateEnd(&zs);
+}
+
+int write_idat_parallel(png_struct *png, struct image *img)
+{
+	int i, hdr, lvlflags;
+	uLong adler = 1;
+	unsigned char zhdr[2], ztrail[4];
+	struct encode_job ej;
+
+	ej.img = img;
+	ej.pixsz = (img->bpp + 7) / 8;
+	ej.rowsz = img->scansz + 1;
+	ej.level = save_zlevel >= 0 ? save_zlevel : Z_DEFAULT_COMPRESSION;
+	ej.failed = 0;
+
+	/* same defaults as libpng: no filtering for indexed and low bit depth
+	 * images, and the filtered strategy whenever there is filtering
+	 */
+	if((ej.filter = save_filter) < 0) {
+		ej.filter = img->cmap_ncolors > 0 || img->bpp / img->nchan < 8 ? FILTER_NONE : FILTER_ADAPTIVE;
+	}
+	if((ej.strategy = save_zstrategy) < 0) {
+		ej.strategy = ej.filter == FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	}
+
+	/* block boundaries depend only on the image, not on the number of threads,
+	 * so the output is always the same
+	 */
+	ej.blkrows = BLOCK_SIZE / ej.rowsz;
+	if(ej.blkrows < 1) ej.blkrows = 1;
+	ej.nblocks = (img->height + ej.blkrows - 1) / ej.blkrows;
+
+	if(!(ej.filtered = malloc((size_t)img->height * ej.rowsz))) {
+		fprintf(stderr, "failed to allocate PNG filtering buffer\n");
+		return -1;
+	}
+	if(!(ej.blk = calloc(ej.nblocks, sizeof *ej.blk))) {
+		fprintf(stderr, "failed to allocate deflate blocks\n");
+		free(ej.filtered);
+		return -1;
+	}
+
+	tpool_run(tpool, ej.nblocks, filter_block, &ej);
+	if(!ej.failed) {
+		tpool_run(tpool, ej.nblocks, deflate_block, &ej);
+	}
+	free(ej.filtered);
+
+	if(ej.failed) {
+		fprintf(stderr, "parallel PNG compression failed\n");
+		for(i=0; i<ej.nblocks; i++) {
+			free(ej.blk[i].out);
+		}
+		free(ej.blk);
+		return -1;
+	}
+
+	/* zlib header for a 32k window, flagged with the compression level */
+	if(ej.strategy >= Z_HUFFMAN_ONLY || (ej.level >= 0 && ej.level < 2)) {
+		lvlflags = 0;
+	} else if(ej.level >= 0 && ej.level < 6) {
+		lvlflags = 1;
+	} else if(ej.level == 6 || ej.level < 0) {
+		lvlflags = 2;
+	} else {
+		lvlflags = 3;
+	}
+	hdr = (Z_DEFLATED | (7 << 4)) << 8 | lvlflags << 6;
+	hdr += 31 - hdr % 31;
+	zhdr[0] = hdr >> 8;
+	zhdr[1] = hdr;
+
+	for(i=0; i<ej.nblocks; i++) {
+		adler = adler32_combine(adler, ej.blk[i].adler, ej.blk[i].insz);
+	}
+	ztrail[0] = adler >> 24;
+	ztrail[1] = adler >> 16;
+	ztrail[2] = adler >> 8;
+	ztrail[3] = adler;
+
+	/* one IDAT per block, the zlib header goes in the first and the checksum
+	 * in the last
+	 */
+	for(i=0; i<ej.nblocks; i++) {
+		png_write_chunk_start(png, (png_const_bytep)"IDAT", ej.blk[i].outsz +
+				(i == 0 ? 2 : 0) + (i == ej.nblocks - 1 ? 4 : 0));
+		if(i == 0) {
+			png_write_chunk_data(png, zhdr, 2);
+		}
+		png_write_chunk_data(png, ej.blk[i].out, ej.blk[i].outsz);
+		if(i == ej.nblocks - 1) {
+			png_write_chunk_data(png, ztrail, 4);
+		}
+		png_write_chunk_end(png);
+		free(ej.blk[i].out);
+	}
+	free(ej.blk);
+	return 0;
+}
@@ -0,0 +1,31 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef PNGENC_H_
+#define PNGENC_H_
+
+#include <png.h>
+#include "image.h"
+
+/* Filters and deflates the pixels of img in independent blocks of scanlines on
+ * the worker pool, joins them into a single zlib stream, and writes it out as
+ * IDAT chunks. The PNG header has to be written already, and IEND is left to
+ * the caller. Uses the save_* compression settings.
+ */
+int write_idat_parallel(png_struct *png, struct image *img);
+
+#endif	/* PNGENC_H_ */
@@ -19,190 +19,1536 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <math.h>
 #include <errno.h>
+#include <stdint.h>
 #include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include "image.h"
+#include "hist.h"
+#include "invcmap.h"
+#include "nearest.h"
+#include "tpool.h"
+#include "util.h"
+#include "wu.h"
+#include "thresh.h"
 
 #define NUM_LEVELS	8
+#define NODE_BLOCK_SIZE	1024
+/* leaf count the tree is allowed to grow to while it's being fed the histogram,
+ * before it has to be reduced down to the requested number of colors. Letting
+ * it grow to 64k gave the same palettes on 17k-62k color images, only slower.
+ */
+#define MAX_FEED_LEAVES	4096
+/* palette refinement stops when an iteration improves the total error by less
+ * than this fraction
+ */
+#define REFINE_MIN_GAIN	0.001
+/* scanlines read, remapped and written at a time by quantize_stream. A multiple
+ * of the largest ordered dithering tile, not that it matters for correctness.
+ */
+#define STREAM_ROWS	64
 
 struct octnode;
+struct nodeblock;
+
+/* binary min-heap of reducible nodes, ordered by nref */
+struct nodeheap {
+	struct octnode **nodes;
+	int count, size;
+};
 
 struct octree {
 	struct octnode *root;
-	struct octnode *redlist[NUM_LEVELS];
+	struct nodeheap redheap[NUM_LEVELS];
+	unsigned int redseq;
 	int redlev;
 	int nleaves, maxcol;
+
+	/* all nodes are carved out of a list of blocks owned by the tree, and
+	 * recycled through a free list, so that they can be released in bulk
+	 */
+	struct nodeblock *blocks;
+	int blk_used;
+	struct octnode *freelist;
 };
 
 struct octnode {
 	int lvl;
 	struct octree *tree;
-	int r, g, b, nref;
+	int64_t r, g, b, nref;
 	int palidx;
 	int nsub, leaf;
 	struct octnode *sub[8];
-	struct octnode *next;
+	int heapidx;		/* position in the reducible heap of its level */
+	unsigned int seq;	/* reducible insertion order, breaks nref ties */
+	struct octnode *next;	/* free list link */
+};
+
+struct nodeblock {
+	struct octnode nodes[NODE_BLOCK_SIZE];
+	struct nodeblock *next;
+};
+
+/* everything needed to map colors to palette indices */
+struct palmatch {
+	struct octree *tree;	/* null if the palette didn't come from an octree */
+	struct nearest nn;
+	struct invcmap inv;
+};
+
+
+static void init_octree(struct octree *tree, int maxcol);
+static void destroy_octree(struct octree *tree);
+
+static struct octnode *alloc_node(struct octree *tree, int lvl);
+static void free_node(struct octnode *n);
+
+static void heap_insert(struct nodeheap *heap, struct octnode *n);
+static void heap_remove(struct nodeheap *heap, struct octnode *n);
+static void heap_update(struct nodeheap *heap, struct octnode *n);
+
+static void add_color(struct octree *tree, int r, int g, int b, int64_t nref);
+static void reduce_colors(struct octree *tree);
+static int assign_colors(struct octnode *n, int next, struct cmapent *cmap);
+static int lookup_color(struct octree *tree, int r, int g, int b);
+static int init_palmatch(struct palmatch *pm, struct octree *tree, struct cmapent *cmap, int ncolors);
+static void destroy_palmatch(struct palmatch *pm);
+static int match_color(struct palmatch *pm, int r, int g, int b);
+static int find_color(struct palmatch *pm, int r, int g, int b);
+static int subidx(int bit, int r, int g, int b);
+static int build_histogram(struct histogram *hist, struct image *img);
+static int stream_histogram(struct histogram *hist, struct image *img, const char *fname);
+static void dest_format(struct image *img, struct image *dest, int maxcol);
+static int gen_palette(struct histogram *hist, struct image *img, int maxcol, int shade_levels,
+		struct cmapent *cmap, struct octree *tree, struct octree **treep);
+static int alloc_dest(struct image *img, struct image *dest);
+static int remap_image(struct image *img, struct image *dest, struct palmatch *pm,
+		enum dither dither);
+static int dither_image(struct image *img, struct image *dest, struct palmatch *pm,
+		enum dither dither);
+static int exact_colors(struct image *img, struct image *dest, struct histogram *hist);
+static unsigned char *exact_palette(struct histogram *hist, struct cmapent *cmap);
+static void exact_rows(struct histogram *hist, unsigned char *slotidx, struct image *img,
+		struct image *dest, unsigned char *rowbuf);
+static int octree_colors(struct octree *tree, struct histogram *hist, struct image *img,
+		int maxcol, int shade_levels, struct cmapent *cmap);
+static int wu_colors(struct histogram *hist, struct image *img, int maxcol, int shade_levels,
+		struct cmapent *cmap);
+static int refine_colors(struct histogram *hist, struct image *img, int shade_levels,
+		struct cmapent *cmap, int ncolors, int maxiter);
+static void print_tree(struct octnode *n, int lvl);
+
+/* inverse colormap precision in bits per channel, 0 to look up every pixel in
+ * the octree instead
+ */
+int quant_lut_bits = 5;
+/* nearest color search method, one of enum nearest_method */
+int quant_nearest = NEAREST_BRUTE;
+/* palette generator, one of enum quant_method */
+int quant_method = QUANT_OCTREE;
+/* maximum number of k-means iterations to refine the palette with, 0 for none */
+int quant_refine = 0;
+
+#define CLAMP(x, a, b)	((x) < (a) ? (a) : ((x) > (b) ? (b) : (x)))
+
+int quantize_image(struct image *img, int maxcol, enum dither dither,
+		int shade_levels, int *shade_lut)
+{
+	int i, j, ncolors, res;
+	unsigned int rgb[3];
+	struct octree tree, *treep = 0;
+	struct image newimg = *img;
+	struct histogram hist;
+	struct palmatch pm;
+	double t0;
+
+	if(maxcol < 2 || maxcol > 256) {
+		return -1;
+	}
+	if(shade_lut && shade_levels <= 1) {
+		return -1;
+	}
+
+	dest_format(img, &newimg, maxcol);
+
+	/* count unique colors first, palettes are generated from the histogram
+	 * rather than from the pixels in scan order
+	 */
+	t0 = get_msec();
+	if(build_histogram(&hist, img) == -1) {
+		return -1;
+	}
+	VERBOSE_TIME(t0, "color histogram");
+	if(verbose) {
+		fprintf(stderr, "  %d unique colors\n", hist.count);
+	}
+
+	/* if the image already fits in maxcol colors, use them as-is. Not when
+	 * generating a shade LUT though, the palette needs room for the ramps.
+	 */
+	if(hist.count <= maxcol && !shade_lut) {
+		t0 = get_msec();
+		if(alloc_dest(img, &newimg) == -1 || exact_colors(img, &newimg, &hist) == -1) {
+			if(newimg.pixels != img->pixels) free(newimg.pixels);
+			destroy_histogram(&hist);
+			return -1;
+		}
+		VERBOSE_TIME(t0, "exact palette and remap");
+		destroy_histogram(&hist);
+		if(newimg.pixels != img->pixels) free_pixels(img);
+		*img = newimg;
+		return 0;
+	}
+
+	ncolors = gen_palette(&hist, img, maxcol, shade_lut ? shade_levels : 0, newimg.cmap, &tree, &treep);
+	destroy_histogram(&hist);
+	if(ncolors == -1) {
+		return -1;
+	}
+	newimg.cmap_ncolors = ncolors;
+
+	/* a refined palette no longer matches the octree leaves, so it can't be
+	 * searched by walking the tree
+	 */
+	if(init_palmatch(&pm, quant_refine > 0 ? 0 : treep, newimg.cmap, newimg.cmap_ncolors) == -1) {
+		if(treep) destroy_octree(treep);
+		return -1;
+	}
+	if(alloc_dest(img, &newimg) == -1) {
+		destroy_palmatch(&pm);
+		if(treep) destroy_octree(treep);
+		return -1;
+	}
+
+	/* replace image pixels. Error diffusion needs the exact nearest color of the
+	 * value with the error added, so it bypasses the inverse colormap.
+	 */
+	t0 = get_msec();
+	if(dither == DITHER_NONE || DITHER_ORDERED(dither)) {
+		res = remap_image(img, &newimg, &pm, dither);
+	} else {
+		res = dither_image(img, &newimg, &pm, dither);
+	}
+	if(res == -1) {
+		if(newimg.pixels != img->pixels) free(newimg.pixels);
+		destroy_palmatch(&pm);
+		if(treep) destroy_octree(treep);
+		return -1;
+	}
+	VERBOSE_TIME(t0, "remap");
+
+	if(shade_lut) {
+		/* populate shade_lut based on the new palette, can't generate levels only
+		 * for the original colors, because the palette entries will have changed
+		 * and moved around.
+		 */
+		for(i=0; i<newimg.cmap_ncolors; i++) {
+			for(j=0; j<shade_levels; j++) {
+				rgb[0] = newimg.cmap[i].r * j / (shade_levels - 1);
+				rgb[1] = newimg.cmap[i].g * j / (shade_levels - 1);
+				rgb[2] = newimg.cmap[i].b * j / (shade_levels - 1);
+				*shade_lut++ = find_color(&pm, rgb[0], rgb[1], rgb[2]);
+			}
+		}
+		for(i=0; i<(maxcol - newimg.cmap_ncolors) * shade_levels; i++) {
+			*shade_lut++ = maxcol - 1;
+		}
+	}
+
+	if(newimg.pixels != img->pixels) free_pixels(img);
+	*img = newimg;
+
+	destroy_palmatch(&pm);
+	if(treep) destroy_octree(treep);
+	return 0;
+}
+
+/* indexed images keep their format, truecolor ones get 8 or 4bpp indices */
+static void dest_format(struct image *img, struct image *dest, int maxcol)
+{
+	if(img->bpp > 8) {
+		dest->bpp = maxcol > 16 ? 8 : 4;
+		dest->nchan = 1;
+		dest->scansz = (dest->width * dest->bpp + 7) / 8;
+		dest->pitch = dest->scansz;
+	}
+}
+
+/* Generates the palette from the histogram with the selected quantizer, and
+ * refines it if requested. If an octree is built in tree, *treep is set to it
+ * and the caller has to destroy it. Returns the number of colors.
+ */
+static int gen_palette(struct histogram *hist, struct image *img, int maxcol, int shade_levels,
+		struct cmapent *cmap, struct octree *tree, struct octree **treep)
+{
+	int ncolors;
+	double t0;
+
+	*treep = 0;
+
+	t0 = get_msec();
+	if(quant_method == QUANT_WU) {
+		ncolors = wu_colors(hist, img, maxcol, shade_levels, cmap);
+	} else {
+		*treep = tree;
+		ncolors = octree_colors(tree, hist, img, maxcol, shade_levels, cmap);
+	}
+	if(ncolors == -1) {
+		return -1;
+	}
+	VERBOSE_TIME(t0, quant_method == QUANT_WU ? "wu palette" : "octree palette");
+
+	if(quant_refine > 0) {
+		t0 = get_msec();
+		if(refine_colors(hist, img, shade_levels, cmap, ncolors, quant_refine) == -1) {
+			if(*treep) destroy_octree(*treep);
+			*treep = 0;
+			return -1;
+		}
+		VERBOSE_TIME(t0, "palette refinement");
+	}
+	return ncolors;
+}
+
+/* Feeds each unique color to the octree once, weighted by its pixel count, in
+ * color order rather than scan order. Shade ramps for the shade LUT are added
+ * afterwards with a weight of a single reference, so that they only claim
+ * palette entries the image doesn't need. Returns the number of colors.
+ */
+static int octree_colors(struct octree *tree, struct histogram *hist, struct image *img,
+		int maxcol, int shade_levels, struct cmapent *cmap)
+{
+	int i, j, maxleaves;
+	unsigned int rgb[3];
+	struct histent *colors;
+
+	if(!(colors = hist_sorted(hist))) {
+		return -1;
+	}
+
+	init_octree(tree, maxcol);
+
+	maxleaves = maxcol > MAX_FEED_LEAVES ? maxcol : MAX_FEED_LEAVES;
+	for(i=0; i<hist->count; i++) {
+		add_color(tree, UNPACK_R(colors[i].rgb), UNPACK_G(colors[i].rgb),
+				UNPACK_B(colors[i].rgb), (int64_t)colors[i].count * 1024);
+
+		while(tree->nleaves > maxleaves) {
+			reduce_colors(tree);
+		}
+	}
+	while(tree->nleaves > maxcol) {
+		reduce_colors(tree);
+	}
+	free(colors);
+
+	if(shade_levels) {
+		/* temporary colormap to add ramps */
+		assign_colors(tree->root, 0, cmap);
+
+		for(i=0; i<img->cmap_ncolors; i++) {
+			for(j=0; j<shade_levels - 1; j++) {
+				rgb[0] = img->cmap[i].r * j / (shade_levels - 1);
+				rgb[1] = img->cmap[i].g * j / (shade_levels - 1);
+				rgb[2] = img->cmap[i].b * j / (shade_levels - 1);
+				add_color(tree, rgb[0], rgb[1], rgb[2], 1);
+
+				while(tree->nleaves > maxcol) {
+					reduce_colors(tree);
+				}
+			}
+		}
+	}
+
+	/* use created octree to generate the palette */
+	return assign_colors(tree->root, 0, cmap);
+}
+
+/* Wu's quantizer over the histogram. Pixel colors are weighted by 1024 per
+ * pixel and shade ramps by 1, same as the octree. Returns the number of colors.
+ */
+static int wu_colors(struct histogram *hist, struct image *img, int maxcol, int shade_levels,
+		struct cmapent *cmap)
+{
+	int i, j, ncolors;
+	unsigned int rgb[3];
+	struct wu_quant wu;
+
+	if(wu_init(&wu) == -1) {
+		return -1;
+	}
+
+	for(i=0; i<hist->size; i++) {
+		if(hist->ent[i].count) {
+			wu_add(&wu, UNPACK_R(hist->ent[i].rgb), UNPACK_G(hist->ent[i].rgb),
+					UNPACK_B(hist->ent[i].rgb), (int64_t)hist->ent[i].count * 1024);
+		}
+	}
+
+	if(shade_levels) {
+		for(i=0; i<img->cmap_ncolors; i++) {
+			for(j=0; j<shade_levels - 1; j++) {
+				rgb[0] = img->cmap[i].r * j / (shade_levels - 1);
+				rgb[1] = img->cmap[i].g * j / (shade_levels - 1);
+				rgb[2] = img->cmap[i].b * j / (shade_levels - 1);
+				wu_add(&wu, rgb[0], rgb[1], rgb[2], 1);
+			}
+		}
+	}
+
+	ncolors = wu_palette(&wu, maxcol, cmap);
+	wu_destroy(&wu);
+	return ncolors;
+}
+
+struct hist_job {
+	struct image *img;
+	struct histogram *hist;
+	int nstripes;
+	int failed;
+};
+
+static void hist_stripe(void *cls, int job)
+{
+	struct hist_job *hj = cls;
+	int y0 = job * hj->img->height / hj->nstripes;
+	int y1 = (job + 1) * hj->img->height / hj->nstripes;
+
+	if(init_histogram(hj->hist + job) == -1 || hist_add_rows(hj->hist + job, hj->img, y0, y1) == -1) {
+		hj->failed = 1;
+	}
+}
+
+/* Each worker counts the colors of a horizontal stripe of the image into its
+ * own histogram, and the stripes are then merged in order. The merged counts
+ * don't depend on the number of stripes, and everything downstream uses the
+ * colors in sorted order, so the output is the same for any thread count.
+ */
+static int build_histogram(struct histogram *hist, struct image *img)
+{
+	int i, nstripes, res = 0;
+	struct hist_job hj;
+
+	nstripes = tpool_num_threads(tpool);
+	if(nstripes > img->height) nstripes = img->height;
+	if(nstripes <= 1) {
+		if(init_histogram(hist) == -1 || hist_add_rows(hist, img, 0, img->height) == -1) {
+			destroy_histogram(hist);
+			return -1;
+		}
+		return 0;
+	}
+
+	if(!(hj.hist = calloc(nstripes, sizeof *hj.hist))) {
+		fprintf(stderr, "failed to allocate per-thread histograms\n");
+		return -1;
+	}
+	hj.img = img;
+	hj.nstripes = nstripes;
+	hj.failed = 0;
+
+	tpool_run(tpool, nstripes, hist_stripe, &hj);
+
+	if(hj.failed || init_histogram(hist) == -1) {
+		res = -1;
+	}
+	for(i=0; i<nstripes; i++) {
+		if(res != -1 && hist_merge(hist, hj.hist + i) == -1) {
+			res = -1;
+		}
+		destroy_histogram(hj.hist + i);
+	}
+	free(hj.hist);
+
+	if(res == -1) {
+		destroy_histogram(hist);
+	}
+	return res;
+}
+
+/* first pass of quantize_stream: reads the file a strip at a time and adds up
+ * the histograms of the strips. img gets the format of the file, but no pixels.
+ */
+static int stream_histogram(struct histogram *hist, struct image *img, const char *fname)
+{
+	int y, res = 0;
+	struct image_stream is;
+	struct image strip;
+	struct histogram striphist;
+
+	if(open_image_stream(&is, img, fname) == -1) {
+		return -1;
+	}
+	strip = *img;
+	if(!(strip.pixels = malloc(STREAM_ROWS * strip.pitch))) {
+		fprintf(stderr, "failed to allocate %d scanline strip buffer\n", STREAM_ROWS);
+		close_image_stream(&is);
+		return -1;
+	}
+	if(init_histogram(hist) == -1) {
+		free(strip.pixels);
+		close_image_stream(&is);
+		return -1;
+	}
+
+	for(y=0; y<img->height; y+=strip.height) {
+		strip.height = img->height - y < STREAM_ROWS ? img->height - y : STREAM_ROWS;
+
+		if(read_image_rows(&is, &strip, strip.height) == -1) {
+			res = -1;
+			break;
+		}
+		if(tpool_num_threads(tpool) <= 1) {
+			res = hist_add_rows(hist, &strip, 0, strip.height);
+		} else if((res = build_histogram(&striphist, &strip)) != -1) {
+			res = hist_merge(hist, &striphist);
+			destroy_histogram(&striphist);
+		}
+		if(res == -1) break;
+	}
+
+	free(strip.pixels);
+	close_image_stream(&is);
+	if(res == -1) {
+		destroy_histogram(hist);
+	}
+	return res;
+}
+
+/* Indexed images are remapped in place, each destination scanline overwrites
+ * its own source scanline. Converting from truecolor packs the destination
+ * scanlines closer together, so rows handled by different workers would
+ * overlap; these get a new pixel buffer.
+ */
+static int alloc_dest(struct image *img, struct image *dest)
+{
+	if(img->bpp <= 8) {
+		return 0;
+	}
+	if(!(dest->pixels = calloc(dest->height, dest->pitch))) {
+		fprintf(stderr, "failed to allocate %dx%d destination image\n", dest->width, dest->height);
+		dest->pixels = img->pixels;
+		return -1;
+	}
+	dest->mapping = 0;
+	dest->mapsz = 0;
+	return 0;
+}
+
+struct remap_job {
+	struct image *img, *dest;
+	struct palmatch *pm;
+	int y0;			/* first scanline of img in the whole image */
+	int nblocks, maxblocks;
+	unsigned char *rowbuf;	/* RGB and index scanline, per block */
+
+	/* ordered dithering threshold offsets, a square tile of 1 << tbits, or
+	 * null for plain remapping
+	 */
+	int *thresh;
+	int tbits;
+};
+
+/* scanline buffers for each of nblocks row blocks: RGB, then indices */
+static unsigned char *alloc_rowbuf(int width, int nblocks)
+{
+	unsigned char *buf;
+
+	if(!(buf = malloc(width * 4 * nblocks))) {
+		fprintf(stderr, "failed to allocate scanline buffers\n");
+	}
+	return buf;
+}
+
+static void remap_block(void *cls, int job)
+{
+	int i, j, y0, y1, width;
+	unsigned char *rgb, *idx, *src;
+	struct remap_job *rj = cls;
+
+	y0 = job * rj->img->height / rj->nblocks;
+	y1 = (job + 1) * rj->img->height / rj->nblocks;
+	width = rj->img->width;
+	rgb = rj->rowbuf + job * width * 4;
+	idx = rgb + width * 3;
+
+	for(i=y0; i<y1; i++) {
+		get_row_rgb(rj->img, i, 0, width, rgb);
+		src = rgb;
+		for(j=0; j<width; j++) {
+			idx[j] = find_color(rj->pm, src[0], src[1], src[2]);
+			src += 3;
+		}
+		put_row_index(rj->dest, i, 0, width, idx);
+	}
+}
+
+static void ordered_block(void *cls, int job)
+{
+	int i, j, y0, y1, off, tmask, width;
+	unsigned char *rgb, *idx, *src;
+	int *trow;
+	struct remap_job *rj = cls;
+
+	y0 = job * rj->img->height / rj->nblocks;
+	y1 = (job + 1) * rj->img->height / rj->nblocks;
+	tmask = (1 << rj->tbits) - 1;
+	width = rj->img->width;
+	rgb = rj->rowbuf + job * width * 4;
+	idx = rgb + width * 3;
+
+	for(i=y0; i<y1; i++) {
+		trow = rj->thresh + (((rj->y0 + i) & tmask) << rj->tbits);
+		get_row_rgb(rj->img, i, 0, width, rgb);
+		src = rgb;
+		for(j=0; j<width; j++) {
+			off = trow[j & tmask];
+			idx[j] = find_color(rj->pm, CLAMP(src[0] + off, 0, 255),
+					CLAMP(src[1] + off, 0, 255), CLAMP(src[2] + off, 0, 255));
+			src += 3;
+		}
+		put_row_index(rj->dest, i, 0, width, idx);
+	}
+}
+
+/* Ordered dithering offsets each pixel by a threshold which only depends on its
+ * position, so it runs in parallel exactly like the plain remap, and a tile
+ * dithers the same wherever it appears on a tile-aligned position. Thresholds
+ * are spread over the average distance between neighbouring palette entries.
+ */
+static int init_thresholds(struct remap_job *rj, struct cmapent *cmap, int ncolors, enum dither dither)
+{
+	int i, j, d, mind, size, count;
+	double spread = 0.0;
+	const unsigned short *bnmask = 0;
+
+	switch(dither) {
+	case DITHER_BAYER2:
+		rj->tbits = 1;
+		break;
+	case DITHER_BAYER4:
+		rj->tbits = 2;
+		break;
+	case DITHER_BAYER8:
+		rj->tbits = 3;
+		break;
+	default:
+		if(!(bnmask = blue_noise_mask())) {
+			return -1;
+		}
+		rj->tbits = BLUE_NOISE_BITS;
+	}
+	size = 1 << rj->tbits;
+	count = size * size;
+
+	for(i=0; i<ncolors; i++) {
+		mind = INT_MAX;
+		for(j=0; j<ncolors; j++) {
+			d = (cmap[i].r - cmap[j].r) * (cmap[i].r - cmap[j].r) +
+				(cmap[i].g - cmap[j].g) * (cmap[i].g - cmap[j].g) +
+				(cmap[i].b - cmap[j].b) * (cmap[i].b - cmap[j].b);
+			if(j != i && d < mind) mind = d;
+		}
+		spread += sqrt(mind);
+	}
+	spread /= ncolors;
+
+	if(!(rj->thresh = malloc(count * sizeof *rj->thresh))) {
+		fprintf(stderr, "failed to allocate dithering threshold table\n");
+		return -1;
+	}
+	for(i=0; i<size; i++) {
+		for(j=0; j<size; j++) {
+			d = bnmask ? bnmask[(i << rj->tbits) | j] : bayer_rank(j, i, rj->tbits);
+			rj->thresh[(i << rj->tbits) | j] = (int)floor(((d + 0.5) / count - 0.5) * spread);
+		}
+	}
+	return 0;
+}
+
+/* sets up remapping of strips of up to maxrows scanlines, with no dithering or
+ * with one of the ordered dithering methods
+ */
+static int init_remap(struct remap_job *rj, struct palmatch *pm, struct cmapent *cmap, int ncolors,
+		int width, int maxrows, enum dither dither)
+{
+	rj->pm = pm;
+	rj->thresh = 0;
+	if(DITHER_ORDERED(dither) && init_thresholds(rj, cmap, ncolors, dither) == -1) {
+		return -1;
+	}
+
+	rj->maxblocks = tpool_num_threads(tpool) * 4;
+	if(rj->maxblocks > maxrows) rj->maxblocks = maxrows;
+
+	if(!(rj->rowbuf = alloc_rowbuf(width, rj->maxblocks))) {
+		free(rj->thresh);
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy_remap(struct remap_job *rj)
+{
+	free(rj->rowbuf);
+	free(rj->thresh);
+}
+
+/* Without error diffusion every pixel is independent, so blocks of whole
+ * scanlines are remapped in parallel. Scanlines start on byte boundaries, so
+ * no two workers ever write to the same byte, even for 4bpp destinations.
+ * img is a strip of the whole image starting at scanline y0.
+ */
+static void remap_rows(struct remap_job *rj, struct image *img, struct image *dest, int y0)
+{
+	rj->img = img;
+	rj->dest = dest;
+	rj->y0 = y0;
+	rj->nblocks = rj->maxblocks > img->height ? img->height : rj->maxblocks;
+
+	tpool_run(tpool, rj->nblocks, rj->thresh ? ordered_block : remap_block, rj);
+}
+
+static int remap_image(struct image *img, struct image *dest, struct palmatch *pm,
+		enum dither dither)
+{
+	struct remap_job rj;
+
+	if(init_remap(&rj, pm, dest->cmap, dest->cmap_ncolors, img->width, img->height, dither) == -1) {
+		return -1;
+	}
+	remap_rows(&rj, img, dest, 0);
+	destroy_remap(&rj);
+	return 0;
+}
+
+/* error rows have this many pixels of padding on each side, to soak up the
+ * error diffused past the edges of the image. Also the farthest any kernel
+ * reaches sideways.
+ */
+#define ERR_PAD		2
+/* farthest any kernel reaches downwards */
+#define ERR_ROWS	2
+#define MAX_TAPS	12
+
+#define FLOOR_DIV(a, b)	((a) >= 0 ? (a) / (b) : -((-(a) + (b) - 1) / (b)))
+
+struct diffusion_tap {
+	int dx, dy, weight;
+};
+
+/* error diffusion kernel, for left to right scanning. Each tap gets its weight
+ * in 1/div of the error, rounded down, and the last tap gets what's left of
+ * total/div, so rounding never loses or creates error.
+ */
+struct diffusion_kernel {
+	const char *name;
+	int div, total;
+	int reach, rows;	/* farthest tap sideways and downwards */
+	int ntaps;
+	struct diffusion_tap taps[MAX_TAPS];
+};
+
+static const struct diffusion_kernel kern_fs = {
+	"Floyd-Steinberg", 16, 16, 1, 1, 4,
+	{{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}}
+};
+/* diffuses only 3/4 of the error, keeps small palettes from bleeding */
+static const struct diffusion_kernel kern_atkinson = {
+	"Atkinson", 8, 6, 2, 2, 6,
+	{{1, 0, 1}, {2, 0, 1}, {-1, 1, 1}, {0, 1, 1}, {1, 1, 1}, {0, 2, 1}}
+};
+static const struct diffusion_kernel kern_sierra_lite = {
+	"Sierra Lite", 4, 4, 1, 1, 3,
+	{{1, 0, 2}, {-1, 1, 1}, {0, 1, 1}}
+};
+static const struct diffusion_kernel kern_jjn = {
+	"Jarvis-Judice-Ninke", 48, 48, 2, 2, 12,
+	{{1, 0, 7}, {2, 0, 5},
+	{-2, 1, 3}, {-1, 1, 5}, {0, 1, 7}, {1, 1, 5}, {2, 1, 3},
+	{-2, 2, 1}, {-1, 2, 3}, {0, 2, 5}, {1, 2, 3}, {2, 2, 1}}
+};
+
+struct dither_job {
+	struct image *img, *dest;
+	struct palmatch *pm;
+	int y0;			/* first scanline of img in the whole image */
+	const struct diffusion_kernel *kern;
+	void (*row)(struct dither_job *dj, int y, unsigned char *rowbuf);
+	int serpentine;
+
+	/* diffused error, rolling buffer of nslots rows of RGB triplets. The error
+	 * carries over from one strip of scanlines to the next.
+	 */
+	int16_t *errbuf;
+	int nslots, errpitch;
+
+	atomic_int *progress;	/* pixels of each scanline of the strip done so far */
+	atomic_int nextrow;
+
+	int nworkers;
+	unsigned char *rowbuf;	/* RGB and index scanline, per worker */
+};
+
+static int16_t *err_row(struct dither_job *dj, int y)
+{
+	return dj->errbuf + ((dj->y0 + y) % dj->nslots) * dj->errpitch + ERR_PAD * 3;
+}
+
+static void wait_progress(struct dither_job *dj, int y, int need, int *ready)
+{
+	while(*ready < need) {
+		*ready = atomic_load_explicit(dj->progress + y, memory_order_acquire);
+		if(*ready < need) sched_yield();
+	}
+}
+
+/* Error diffusion on one scanline. The error for this and the following rows
+ * lives in the rolling error rows, the source image is never modified. Each
+ * error cell is cleared as soon as it's consumed, so the row is ready for reuse
+ * when done. Called with a constant kernel from the per-kernel functions below,
+ * so that the tap loops get unrolled with their weights folded in.
+ */
+static inline void diffuse_row(struct dither_job *dj, int y, unsigned char *rowbuf,
+		const struct diffusion_kernel *kern)
+{
+	int i, k, c, x, dir, cidx, need, lag, ready, slot_ready, e, part, sum;
+	int val[3], pal[3];
+	unsigned char *rgb = rowbuf, *idx = rowbuf + dj->img->width * 3;
+	int16_t *erow[ERR_ROWS + 1], *ep;
+	struct image *img = dj->img;
+	struct cmapent *cmap = dj->dest->cmap;
+	int width = img->width;
+	const struct diffusion_tap *last = kern->taps + kern->ntaps - 1;
+
+	/* the lowest row this one diffuses into reuses the error row of an earlier
+	 * scanline, which has to be done with it
+	 */
+	slot_ready = 0;
+	if(y + kern->rows >= dj->nslots) {
+		wait_progress(dj, y + kern->rows - dj->nslots, width, &slot_ready);
+	}
+
+	for(i=0; i<=kern->rows; i++) {
+		erow[i] = err_row(dj, y + i);
+	}
+
+	dir = dj->serpentine && ((dj->y0 + y) & 1) ? -1 : 1;
+	x = dir > 0 ? 0 : width - 1;
+
+	get_row_rgb(img, y, 0, width, rgb);
+
+	/* pixel x gets error from pixels up to x + reach of the row above, which
+	 * also spreads error over pixels up to x + 2 * reach of this row. Following
+	 * that far behind means no two rows ever touch the same error cell at the
+	 * same time. Only forward scans run in parallel, serpentine is serial.
+	 */
+	lag = kern->reach * 2 + 1;
+	ready = y > 0 ? 0 : width;
+
+	for(i=0; i<width; i++) {
+		need = i + lag < width ? i + lag : width;
+		if(ready < need) {
+			wait_progress(dj, y - 1, need, &ready);
+		}
+
+		ep = erow[0] + x * 3;
+		for(c=0; c<3; c++) {
+			val[c] = CLAMP(rgb[x * 3 + c] + ep[c], 0, 255);
+			ep[c] = 0;
+		}
+
+		cidx = match_color(dj->pm, val[0], val[1], val[2]);
+		idx[x] = cidx;
+
+		pal[0] = cmap[cidx].r;
+		pal[1] = cmap[cidx].g;
+		pal[2] = cmap[cidx].b;
+
+		for(c=0; c<3; c++) {
+			e = val[c] - pal[c];
+			sum = 0;
+			for(k=0; k<kern->ntaps - 1; k++) {
+				part = FLOOR_DIV(e * kern->taps[k].weight, kern->div);
+				erow[kern->taps[k].dy][(x + kern->taps[k].dx * dir) * 3 + c] += part;
+				sum += part;
+			}
+			erow[last->dy][(x + last->dx * dir) * 3 + c] += FLOOR_DIV(e * kern->total, kern->div) - sum;
+		}
+
+		if((i & 7) == 7) {
+			atomic_store_explicit(dj->progress + y, i + 1, memory_order_release);
+		}
+		x += dir;
+	}
+
+	/* clear whatever spilled into the padding */
+	memset(erow[0] - ERR_PAD * 3, 0, ERR_PAD * 3 * sizeof *erow[0]);
+	memset(erow[0] + width * 3, 0, ERR_PAD * 3 * sizeof *erow[0]);
+
+	put_row_index(dj->dest, y, 0, width, idx);
+
+	atomic_store_explicit(dj->progress + y, width, memory_order_release);
+}
+
+#define DIFFUSION_ROW_FUNC(func, kern) \
+	static void func(struct dither_job *dj, int y, unsigned char *rowbuf) \
+	{ \
+		diffuse_row(dj, y, rowbuf, &kern); \
+	}
+
+DIFFUSION_ROW_FUNC(diffuse_row_fs, kern_fs)
+DIFFUSION_ROW_FUNC(diffuse_row_atkinson, kern_atkinson)
+DIFFUSION_ROW_FUNC(diffuse_row_sierra_lite, kern_sierra_lite)
+DIFFUSION_ROW_FUNC(diffuse_row_jjn, kern_jjn)
+
+static const struct {
+	enum dither dither;
+	const struct diffusion_kernel *kern;
+	void (*row)(struct dither_job *dj, int y, unsigned char *rowbuf);
+} diffusion[] = {
+	{DITHER_FLOYD_STEINBERG, &kern_fs, diffuse_row_fs},
+	{DITHER_ATKINSON, &kern_atkinson, diffuse_row_atkinson},
+	{DITHER_SIERRA_LITE, &kern_sierra_lite, diffuse_row_sierra_lite},
+	{DITHER_JJN, &kern_jjn, diffuse_row_jjn}
+};
+
+static void dither_worker(void *cls, int job)
+{
+	int y;
+	struct dither_job *dj = cls;
+	unsigned char *rowbuf = dj->rowbuf + job * dj->img->width * 4;
+
+	while((y = atomic_fetch_add(&dj->nextrow, 1)) < dj->img->height) {
+		dj->row(dj, y, rowbuf);
+	}
+}
+
+/* sets up error diffusion over strips of up to maxrows scanlines */
+static int init_dither(struct dither_job *dj, struct palmatch *pm, int width, int maxrows,
+		enum dither dither)
+{
+	int i;
+
+	for(i=0; i<sizeof diffusion / sizeof *diffusion - 1; i++) {
+		if(diffusion[i].dither == (dither & ~DITHER_SERPENTINE)) break;
+	}
+	dj->kern = diffusion[i].kern;
+	dj->row = diffusion[i].row;
+	dj->pm = pm;
+
+	dj->serpentine = (dither & DITHER_SERPENTINE) != 0;
+
+	dj->nworkers = dj->serpentine ? 1 : tpool_num_threads(tpool);
+	if(dj->nworkers > maxrows) dj->nworkers = maxrows;
+
+	dj->nslots = dj->nworkers + dj->kern->rows;
+	dj->errpitch = (width + ERR_PAD * 2) * 3;
+	if(!(dj->errbuf = calloc(dj->nslots * dj->errpitch, sizeof *dj->errbuf))) {
+		fprintf(stderr, "failed to allocate dithering error rows\n");
+		return -1;
+	}
+	if(!(dj->progress = malloc(maxrows * sizeof *dj->progress))) {
+		fprintf(stderr, "failed to allocate dithering progress counters\n");
+		free(dj->errbuf);
+		return -1;
+	}
+	if(!(dj->rowbuf = alloc_rowbuf(width, dj->nworkers))) {
+		free(dj->progress);
+		free(dj->errbuf);
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy_dither(struct dither_job *dj)
+{
+	free(dj->rowbuf);
+	free(dj->progress);
+	free(dj->errbuf);
+}
+
+/* Error diffusion, processed as a wavefront: every worker grabs the next
+ * scanline and follows a few pixels behind the scanline above it. Rows are
+ * handed out in order, so each row waits only on rows which are already being
+ * worked on. Error sums are plain integer additions, so the result is the same
+ * as the serial algorithm. With one worker this is the usual set of rolling
+ * error rows. img is a strip of the whole image starting at scanline y0, and
+ * strips have to be passed in order.
+ */
+static void dither_rows(struct dither_job *dj, struct image *img, struct image *dest, int y0)
+{
+	int i;
+
+	for(i=0; i<img->height; i++) {
+		atomic_init(dj->progress + i, 0);
+	}
+	atomic_init(&dj->nextrow, 0);
+	dj->img = img;
+	dj->dest = dest;
+	dj->y0 = y0;
+
+	tpool_run(dj->nworkers > 1 ? tpool : 0, dj->nworkers, dither_worker, dj);
+}
+
+static int dither_image(struct image *img, struct image *dest, struct palmatch *pm,
+		enum dither dither)
+{
+	struct dither_job dj;
+	double t0;
+
+	if(init_dither(&dj, pm, img->width, img->height, dither) == -1) {
+		return -1;
+	}
+
+	t0 = get_msec();
+	dither_rows(&dj, img, dest, 0);
+
+	if(verbose) {
+		t0 = get_msec() - t0;
+		fprintf(stderr, "  %s%s: %.2f Mpixels/s\n", dj.kern->name, dj.serpentine ? " (serpentine)" : "",
+				t0 > 0.0 ? (double)img->width * img->height / (t0 * 1000.0) : 0.0);
+	}
+
+	destroy_dither(&dj);
+	return 0;
+}
+
+/* state of the second pass of quantize_stream, one of: exact colors through
+ * slotidx, error diffusion through dj, or plain and ordered remapping through rj
+ */
+struct stream_map {
+	struct histogram *hist;
+	unsigned char *slotidx, *rowbuf;
+	struct palmatch *pm;
+	enum dither dither;
+	struct remap_job rj;
+	struct dither_job dj;
 };
 
+static int stream_remap(struct stream_map *sm, struct image *img, struct image *dest,
+		const char *fname, FILE *out, int png)
+{
+	int y, res = 0;
+	struct image_stream is, os;
+	struct image strip, dstrip;
 
-static void init_octree(struct octree *tree, int maxcol);
-static void destroy_octree(struct octree *tree);
+	if(open_image_stream(&is, &strip, fname) == -1) {
+		return -1;
+	}
+	if(strip.width != img->width || strip.height != img->height || strip.bpp != img->bpp) {
+		fprintf(stderr, "%s changed between the two passes\n", fname);
+		close_image_stream(&is);
+		return -1;
+	}
 
-static struct octnode *alloc_node(struct octree *tree, int lvl);
-static void free_node(struct octnode *n);
-static void free_tree(struct octnode *n);
+	/* cleared, so that the unused bits at the end of 4bpp scanlines are 0 */
+	dstrip = *dest;
+	if(!(strip.pixels = calloc(STREAM_ROWS, strip.pitch + dstrip.pitch))) {
+		fprintf(stderr, "failed to allocate %d scanline strip buffers\n", STREAM_ROWS);
+		close_image_stream(&is);
+		return -1;
+	}
+	dstrip.pixels = strip.pixels + STREAM_ROWS * strip.pitch;
 
-static void add_color(struct octree *tree, int r, int g, int b, int nref);
-static void reduce_colors(struct octree *tree);
-static int assign_colors(struct octnode *n, int next, struct cmapent *cmap);
-static int lookup_color(struct octree *tree, int r, int g, int b);
-static int subidx(int bit, int r, int g, int b);
-static void print_tree(struct octnode *n, int lvl);
+	if(png && create_image_stream(&os, dest, out) == -1) {
+		free(strip.pixels);
+		close_image_stream(&is);
+		return -1;
+	}
 
+	for(y=0; y<img->height; y+=strip.height) {
+		strip.height = img->height - y < STREAM_ROWS ? img->height - y : STREAM_ROWS;
+		dstrip.height = strip.height;
 
-#define CLAMP(x, a, b)	((x) < (a) ? (a) : ((x) > (b) ? (b) : (x)))
-static void add_error(struct image *dest, int x, int y, int *err, int s, int *acc)
-{
-	int r, g, b;
-	unsigned int pixel[3];
-
-	if(s) {
-		r = s * err[0] >> 4;
-		g = s * err[1] >> 4;
-		b = s * err[2] >> 4;
-		acc[0] += r;
-		acc[1] += g;
-		acc[2] += b;
-	} else {
-		r = err[0];
-		g = err[1];
-		b = err[2];
+		if(read_image_rows(&is, &strip, strip.height) == -1) {
+			res = -1;
+			break;
+		}
+
+		if(sm->slotidx) {
+			exact_rows(sm->hist, sm->slotidx, &strip, &dstrip, sm->rowbuf);
+		} else if(sm->dither == DITHER_NONE || DITHER_ORDERED(sm->dither)) {
+			remap_rows(&sm->rj, &strip, &dstrip, y);
+		} else {
+			dither_rows(&sm->dj, &strip, &dstrip, y);
+		}
+
+		if(png) {
+			res = write_image_rows(&os, &dstrip, dstrip.height);
+		} else if(fwrite(dstrip.pixels, dstrip.scansz, dstrip.height, out) < dstrip.height) {
+			res = -1;
+		}
+		if(res == -1) {
+			fprintf(stderr, "failed to write scanlines %d-%d\n", y, y + dstrip.height - 1);
+			break;
+		}
 	}
-	get_pixel_rgb(dest, x, y, pixel);
-	r += pixel[0];
-	g += pixel[1];
-	b += pixel[2];
-	pixel[0] = CLAMP(r, 0, 255);
-	pixel[1] = CLAMP(g, 0, 255);
-	pixel[2] = CLAMP(b, 0, 255);
-	put_pixel_rgb(dest, x, y, pixel);
-}
 
+	if(png && close_image_stream(&os) == -1) {
+		res = -1;
+	}
+	close_image_stream(&is);
+	free(strip.pixels);
+	return res;
+}
 
-int quantize_image(struct image *img, int maxcol, enum dither dither,
-		int shade_levels, int *shade_lut)
+/* Quantizes a PNG file too large to load in two passes over the file, keeping
+ * only a few strips of scanlines in memory. The first pass builds the color
+ * histogram and the palette, the second remaps each strip and writes it out
+ * as soon as it's done, as PNG or raw pixels. Error diffusion carries its
+ * error rows over from strip to strip. The result is the same as
+ * quantize_image. img gets the format and palette of the output, but no pixels.
+ */
+int quantize_stream(const char *fname, struct image *img, FILE *out, int png, int maxcol,
+		enum dither dither)
 {
-	int i, j, cidx;
-	unsigned int rgb[3];
-	struct octree tree;
-	struct image newimg = *img;
-	int err[3], acc[3];
+	int ncolors, res;
+	struct image src;
+	struct histogram hist;
+	struct octree tree, *treep = 0;
+	struct palmatch pm;
+	struct stream_map sm;
+	double t0;
 
 	if(maxcol < 2 || maxcol > 256) {
 		return -1;
 	}
-	if(shade_lut && shade_levels <= 1) {
+
+	t0 = get_msec();
+	if(stream_histogram(&hist, &src, fname) == -1) {
+		return -1;
+	}
+	VERBOSE_TIME(t0, "color histogram");
+	if(verbose) {
+		fprintf(stderr, "  %d unique colors\n", hist.count);
+	}
+	if(src.bpp <= 8 && src.cmap_ncolors <= maxcol) {
+		fprintf(stderr, "requested reduction to %d colors, but image has %d colors\n", maxcol,
+				src.cmap_ncolors);
+		destroy_histogram(&hist);
 		return -1;
 	}
 
-	if(img->bpp > 8) {
-		newimg.bpp = maxcol > 16 ? 8 : 4;
-		newimg.nchan = 1;
-		newimg.scansz = newimg.width * newimg.bpp / 8;
-		newimg.pitch = newimg.scansz;
+	*img = src;
+	dest_format(&src, img, maxcol);
+
+	memset(&sm, 0, sizeof sm);
+	sm.hist = &hist;
+	sm.dither = dither;
+
+	t0 = get_msec();
+	if(hist.count <= maxcol) {
+		if(!(sm.slotidx = exact_palette(&hist, img->cmap))) {
+			destroy_histogram(&hist);
+			return -1;
+		}
+		img->cmap_ncolors = hist.count;
+		if(!(sm.rowbuf = alloc_rowbuf(src.width, 1))) {
+			free(sm.slotidx);
+			destroy_histogram(&hist);
+			return -1;
+		}
+		res = stream_remap(&sm, &src, img, fname, out, png);
+		free(sm.rowbuf);
+		free(sm.slotidx);
+		destroy_histogram(&hist);
+		VERBOSE_TIME(t0, "exact palette and remap");
+		return res;
+	}
+
+	ncolors = gen_palette(&hist, &src, maxcol, 0, img->cmap, &tree, &treep);
+	destroy_histogram(&hist);
+	if(ncolors == -1) {
+		return -1;
+	}
+	img->cmap_ncolors = ncolors;
+
+	if(init_palmatch(&pm, quant_refine > 0 ? 0 : treep, img->cmap, img->cmap_ncolors) == -1) {
+		if(treep) destroy_octree(treep);
+		return -1;
+	}
+	sm.pm = &pm;
+
+	t0 = get_msec();
+	if(dither == DITHER_NONE || DITHER_ORDERED(dither)) {
+		res = init_remap(&sm.rj, &pm, img->cmap, img->cmap_ncolors, src.width, STREAM_ROWS, dither);
+		if(res != -1) {
+			res = stream_remap(&sm, &src, img, fname, out, png);
+			destroy_remap(&sm.rj);
+		}
+	} else {
+		res = init_dither(&sm.dj, &pm, src.width, STREAM_ROWS, dither);
+		if(res != -1) {
+			res = stream_remap(&sm, &src, img, fname, out, png);
+			destroy_dither(&sm.dj);
+		}
 	}
+	VERBOSE_TIME(t0, "remap");
 
-	init_octree(&tree, maxcol);
+	destroy_palmatch(&pm);
+	if(treep) destroy_octree(treep);
+	return res;
+}
 
-	for(i=0; i<img->height; i++) {
-		for(j=0; j<img->width; j++) {
-			get_pixel_rgb(img, j, i, rgb);
-			add_color(&tree, rgb[0], rgb[1], rgb[2], 1024);
+int quant_method_from_name(const char *name)
+{
+	if(strcmp(name, "octree") == 0) {
+		return QUANT_OCTREE;
+	}
+	if(strcmp(name, "wu") == 0) {
+		return QUANT_WU;
+	}
+	return -1;
+}
+
+static const struct {
+	const char *name;
+	enum dither dither;
+} dither_names[] = {
+	{"none", DITHER_NONE},
+	{"fs", DITHER_FLOYD_STEINBERG},
+	{"atkinson", DITHER_ATKINSON},
+	{"sierra-lite", DITHER_SIERRA_LITE},
+	{"jjn", DITHER_JJN},
+	{"bayer2", DITHER_BAYER2},
+	{"bayer4", DITHER_BAYER4},
+	{"bayer8", DITHER_BAYER8},
+	{"bluenoise", DITHER_BLUE_NOISE}
+};
+
+/* error diffusion methods take a -serp suffix for serpentine scanning */
+int dither_from_name(const char *name)
+{
+	int i, len, serp = 0;
+
+	len = strlen(name);
+	if(len > 5 && strcmp(name + len - 5, "-serp") == 0) {
+		serp = 1;
+		len -= 5;
+	}
 
-			while(tree.nleaves > maxcol) {
-				reduce_colors(&tree);
+	for(i=0; i<sizeof dither_names / sizeof *dither_names; i++) {
+		if(strncmp(name, dither_names[i].name, len) == 0 && !dither_names[i].name[len]) {
+			if(!serp) {
+				return dither_names[i].dither;
+			}
+			if(dither_names[i].dither == DITHER_NONE || DITHER_ORDERED(dither_names[i].dither)) {
+				return -1;
 			}
+			return dither_names[i].dither | DITHER_SERPENTINE;
 		}
 	}
+	return -1;
+}
 
-	if(shade_lut) {
-		/* temporary colormap to add ramps */
-		newimg.cmap_ncolors = assign_colors(tree.root, 0, newimg.cmap);
+struct refine_point {
+	int r, g, b;
+	int cell;
+	int64_t weight;
+};
+
+/* per block color sums, for the new centroids */
+struct refine_sums {
+	int64_t r[256], g[256], b[256], w[256];
+	int64_t err;
+};
+
+struct refine_job {
+	struct refine_point *pts;
+	int npts, nblocks;
+	struct cmapent *cmap;
+	int ncolors;
+	struct refine_sums *sums;
+};
+
+#define REFINE_CELL_BITS	4
+#define REFINE_CELL_SIZE	(1 << (8 - REFINE_CELL_BITS))
+#define REFINE_CELL(r, g, b) \
+	((((r) >> (8 - REFINE_CELL_BITS)) << (REFINE_CELL_BITS * 2)) | \
+	 (((g) >> (8 - REFINE_CELL_BITS)) << REFINE_CELL_BITS) | ((b) >> (8 - REFINE_CELL_BITS)))
+
+/* Palette entries which can be the nearest to any color in a grid cell: those
+ * closer to the cell than the farthest point of the cell is from the entry
+ * which is closest at worst. Returns them in index order, so that ties still
+ * resolve to the lowest palette index.
+ */
+static int cell_candidates(struct cmapent *cmap, int ncolors, int cell, int *cand,
+		struct cmapent *candcmap)
+{
+	int i, j, lo[3], c[3], d, dmin[256], dmax, bound = INT_MAX, ncand = 0;
+
+	lo[0] = (cell >> (REFINE_CELL_BITS * 2)) * REFINE_CELL_SIZE;
+	lo[1] = ((cell >> REFINE_CELL_BITS) & ((1 << REFINE_CELL_BITS) - 1)) * REFINE_CELL_SIZE;
+	lo[2] = (cell & ((1 << REFINE_CELL_BITS) - 1)) * REFINE_CELL_SIZE;
+
+	for(i=0; i<ncolors; i++) {
+		c[0] = cmap[i].r;
+		c[1] = cmap[i].g;
+		c[2] = cmap[i].b;
+
+		dmin[i] = dmax = 0;
+		for(j=0; j<3; j++) {
+			if(c[j] < lo[j]) {
+				d = lo[j] - c[j];
+				dmin[i] += d * d;
+			} else if(c[j] > lo[j] + REFINE_CELL_SIZE - 1) {
+				d = c[j] - (lo[j] + REFINE_CELL_SIZE - 1);
+				dmin[i] += d * d;
+			}
+			d = c[j] - lo[j] > lo[j] + REFINE_CELL_SIZE - 1 - c[j] ?
+				c[j] - lo[j] : lo[j] + REFINE_CELL_SIZE - 1 - c[j];
+			dmax += d * d;
+		}
+		if(dmax < bound) bound = dmax;
+	}
+
+	for(i=0; i<ncolors; i++) {
+		if(dmin[i] <= bound) {
+			cand[ncand] = i;
+			candcmap[ncand++] = cmap[i];
+		}
+	}
+	return ncand;
+}
+
+/* points are sorted by grid cell, so each block only sets up a new nearest
+ * color search when it crosses into a new cell
+ */
+static void refine_block(void *cls, int job)
+{
+	int idx, dr, dg, db, cell = -1;
+	int cand[256];
+	struct cmapent candcmap[256];
+	struct nearest nn;
+	struct refine_job *rj = cls;
+	struct refine_sums *sums = rj->sums + job;
+	struct refine_point *pt = rj->pts + (int64_t)job * rj->npts / rj->nblocks;
+	struct refine_point *end = rj->pts + (int64_t)(job + 1) * rj->npts / rj->nblocks;
+
+	memset(sums, 0, sizeof *sums);
+
+	while(pt < end) {
+		if(pt->cell != cell) {
+			cell = pt->cell;
+			init_nearest(&nn, NEAREST_BRUTE, candcmap,
+					cell_candidates(rj->cmap, rj->ncolors, cell, cand, candcmap));
+		}
+		idx = cand[nearest_color(&nn, pt->r, pt->g, pt->b)];
+
+		dr = pt->r - rj->cmap[idx].r;
+		dg = pt->g - rj->cmap[idx].g;
+		db = pt->b - rj->cmap[idx].b;
+		sums->err += pt->weight * (dr * dr + dg * dg + db * db);
+
+		sums->r[idx] += pt->weight * pt->r;
+		sums->g[idx] += pt->weight * pt->g;
+		sums->b[idx] += pt->weight * pt->b;
+		sums->w[idx] += pt->weight;
+		pt++;
+	}
+}
 
+static void add_refine_point(struct refine_point *pt, int r, int g, int b, int64_t weight)
+{
+	pt->r = r;
+	pt->g = g;
+	pt->b = b;
+	pt->cell = REFINE_CELL(r, g, b);
+	pt->weight = weight;
+}
+
+/* K-means (Lloyd) iterations over the unique colors, weighted the same way as
+ * when the palette was generated: each color is assigned to its nearest palette
+ * entry with the brute force search, and each entry moves to the centroid of
+ * its colors. Entries which attract no colors stay put. The sums are integers,
+ * so the result doesn't depend on how the work is split between threads.
+ */
+static int refine_colors(struct histogram *hist, struct image *img, int shade_levels,
+		struct cmapent *cmap, int ncolors, int maxiter)
+{
+	int i, j, iter, npts, nblocks, ncells;
+	struct refine_point *pts, *sorted;
+	struct refine_sums *sums;
+	struct refine_job rj;
+	struct cmapent prev_cmap[256];
+	int64_t err, prev_err = 0;
+	int *cellstart;
+
+	npts = hist->count;
+	if(shade_levels) {
+		npts += img->cmap_ncolors * (shade_levels - 1);
+	}
+	nblocks = tpool_num_threads(tpool) * 4;
+	if(nblocks > npts) nblocks = npts;
+	ncells = 1 << (REFINE_CELL_BITS * 3);
+
+	if(!(pts = malloc(npts * 2 * sizeof *pts))) {
+		fprintf(stderr, "failed to allocate palette refinement points\n");
+		return -1;
+	}
+	sorted = pts + npts;
+	if(!(sums = malloc(nblocks * sizeof *sums))) {
+		fprintf(stderr, "failed to allocate palette refinement sums\n");
+		free(pts);
+		return -1;
+	}
+	if(!(cellstart = calloc(ncells + 1, sizeof *cellstart))) {
+		fprintf(stderr, "failed to allocate palette refinement grid\n");
+		free(sums);
+		free(pts);
+		return -1;
+	}
+
+	npts = 0;
+	for(i=0; i<hist->size; i++) {
+		if(hist->ent[i].count) {
+			add_refine_point(pts + npts++, UNPACK_R(hist->ent[i].rgb), UNPACK_G(hist->ent[i].rgb),
+					UNPACK_B(hist->ent[i].rgb), (int64_t)hist->ent[i].count * 1024);
+		}
+	}
+	if(shade_levels) {
 		for(i=0; i<img->cmap_ncolors; i++) {
 			for(j=0; j<shade_levels - 1; j++) {
-				rgb[0] = img->cmap[i].r * j / (shade_levels - 1);
-				rgb[1] = img->cmap[i].g * j / (shade_levels - 1);
-				rgb[2] = img->cmap[i].b * j / (shade_levels - 1);
-				add_color(&tree, rgb[0], rgb[1], rgb[2], 1);
-
-				while(tree.nleaves > maxcol) {
-					reduce_colors(&tree);
-				}
+				add_refine_point(pts + npts++, img->cmap[i].r * j / (shade_levels - 1),
+						img->cmap[i].g * j / (shade_levels - 1),
+						img->cmap[i].b * j / (shade_levels - 1), 1);
 			}
 		}
 	}
 
-	/* use created octree to generate the palette */
-	newimg.cmap_ncolors = assign_colors(tree.root, 0, newimg.cmap);
+	/* counting sort by grid cell */
+	for(i=0; i<npts; i++) {
+		cellstart[pts[i].cell + 1]++;
+	}
+	for(i=0; i<ncells; i++) {
+		cellstart[i + 1] += cellstart[i];
+	}
+	for(i=0; i<npts; i++) {
+		sorted[cellstart[pts[i].cell]++] = pts[i];
+	}
+	free(cellstart);
+
+	rj.pts = sorted;
+	rj.npts = npts;
+	rj.nblocks = nblocks;
+	rj.cmap = cmap;
+	rj.ncolors = ncolors;
+	rj.sums = sums;
+
+	for(iter=0; iter<maxiter; iter++) {
+		tpool_run(tpool, nblocks, refine_block, &rj);
+
+		for(i=1; i<nblocks; i++) {
+			for(j=0; j<ncolors; j++) {
+				sums->r[j] += sums[i].r[j];
+				sums->g[j] += sums[i].g[j];
+				sums->b[j] += sums[i].b[j];
+				sums->w[j] += sums[i].w[j];
+			}
+			sums->err += sums[i].err;
+		}
+		err = sums->err;
 
-	/* replace image pixels */
-	for(i=0; i<img->height; i++) {
-		for(j=0; j<img->width; j++) {
-			get_pixel_rgb(img, j, i, rgb);
-			cidx = lookup_color(&tree, rgb[0], rgb[1], rgb[2]);
-			assert(cidx >= 0 && cidx < maxcol);
-			put_pixel(&newimg, j, i, cidx);
-
-			switch(dither) {
-			case DITHER_FLOYD_STEINBERG:
-				err[0] = (int)rgb[0] - (int)newimg.cmap[cidx].r;
-				err[1] = (int)rgb[1] - (int)newimg.cmap[cidx].g;
-				err[2] = (int)rgb[2] - (int)newimg.cmap[cidx].b;
-				acc[0] = acc[1] = acc[2] = 0;
-				if(j < img->width - 1) {
-					add_error(img, j + 1, i, err, 7, acc);
-				}
-				if(i < img->height - 1) {
-					if(j > 0) {
-						add_error(img, j - 1, i + 1, err, 3, acc);
-					}
-					add_error(img, j, i + 1, err, 5, acc);
-					if(j < img->width - 1) {
-						err[0] -= acc[0];
-						err[1] -= acc[1];
-						err[2] -= acc[2];
-						add_error(img, j + 1, i + 1, err, 0, 0);
-					}
-				}
+		if(verbose) {
+			fprintf(stderr, "  refinement pass %d: error %g\n", iter, (double)err / 1024.0);
+		}
+
+		if(iter > 0) {
+			if(err >= prev_err) {
+				/* rounding to integer colors can make things slightly worse */
+				memcpy(cmap, prev_cmap, ncolors * sizeof *cmap);
 				break;
-			default:
+			}
+			if(prev_err - err < prev_err * REFINE_MIN_GAIN) {
 				break;
 			}
 		}
-	}
-
-	if(shade_lut) {
-		/* populate shade_lut based on the new palette, can't generate levels only
-		 * for the original colors, because the palette entries will have changed
-		 * and moved around.
-		 */
-		for(i=0; i<newimg.cmap_ncolors; i++) {
-			for(j=0; j<shade_levels; j++) {
-				rgb[0] = newimg.cmap[i].r * j / (shade_levels - 1);
-				rgb[1] = newimg.cmap[i].g * j / (shade_levels - 1);
-				rgb[2] = newimg.cmap[i].b * j / (shade_levels - 1);
-				*shade_lut++ = lookup_color(&tree, rgb[0], rgb[1], rgb[2]);
+		prev_err = err;
+		memcpy(prev_cmap, cmap, ncolors * sizeof *cmap);
+
+		for(i=0; i<ncolors; i++) {
+			if(sums->w[i] > 0) {
+				cmap[i].r = (sums->r[i] + sums->w[i] / 2) / sums->w[i];
+				cmap[i].g = (sums->g[i] + sums->w[i] / 2) / sums->w[i];
+				cmap[i].b = (sums->b[i] + sums->w[i] / 2) / sums->w[i];
 			}
 		}
-		for(i=0; i<(maxcol - newimg.cmap_ncolors) * shade_levels; i++) {
-			*shade_lut++ = maxcol - 1;
+	}
+
+	free(sums);
+	free(pts);
+	return 0;
+}
+
+/* palette made of exactly the colors in the histogram, and each pixel replaced
+ * by the index of its own color. No octree, no averaging, no error to diffuse.
+ * Returns a table of palette indices for each histogram slot.
+ */
+static unsigned char *exact_palette(struct histogram *hist, struct cmapent *cmap)
+{
+	int i;
+	struct histent *colors;
+	unsigned char *slotidx;
+
+	if(!(colors = hist_sorted(hist))) {
+		return 0;
+	}
+	if(!(slotidx = malloc(hist->size))) {
+		fprintf(stderr, "failed to allocate color index table\n");
+		free(colors);
+		return 0;
+	}
+
+	for(i=0; i<hist->count; i++) {
+		cmap[i].r = UNPACK_R(colors[i].rgb);
+		cmap[i].g = UNPACK_G(colors[i].rgb);
+		cmap[i].b = UNPACK_B(colors[i].rgb);
+		slotidx[hist_lookup(hist, colors[i].rgb)] = i;
+	}
+
+	free(colors);
+	return slotidx;
+}
+
+static void exact_rows(struct histogram *hist, unsigned char *slotidx, struct image *img,
+		struct image *dest, unsigned char *rowbuf)
+{
+	int i, j, slot;
+	unsigned char *rgb = rowbuf, *idx = rowbuf + img->width * 3, *src;
+
+	for(i=0; i<img->height; i++) {
+		get_row_rgb(img, i, 0, img->width, rgb);
+		src = rgb;
+		for(j=0; j<img->width; j++) {
+			slot = hist_lookup(hist, PACK_RGB(src[0], src[1], src[2]));
+			assert(slot >= 0);
+			idx[j] = slotidx[slot];
+			src += 3;
 		}
+		put_row_index(dest, i, 0, img->width, idx);
 	}
+}
 
-	*img = newimg;
+static int exact_colors(struct image *img, struct image *dest, struct histogram *hist)
+{
+	unsigned char *slotidx, *rowbuf;
+
+	if(!(slotidx = exact_palette(hist, dest->cmap))) {
+		return -1;
+	}
+	dest->cmap_ncolors = hist->count;
 
-	destroy_octree(&tree);
+	if(!(rowbuf = alloc_rowbuf(img->width, 1))) {
+		free(slotidx);
+		return -1;
+	}
+	exact_rows(hist, slotidx, img, dest, rowbuf);
+
+	free(rowbuf);
+	free(slotidx);
 	return 0;
 }
 
@@ -218,25 +1564,51 @@ static void init_octree(struct octree *tree, int maxcol)
 
 static void destroy_octree(struct octree *tree)
 {
-	free_tree(tree->root);
+	int i;
+	struct nodeblock *blk;
+
+	for(i=0; i<NUM_LEVELS; i++) {
+		free(tree->redheap[i].nodes);
+	}
+
+	while(tree->blocks) {
+		blk = tree->blocks;
+		tree->blocks = blk->next;
+		free(blk);
+	}
+	tree->root = 0;
+	tree->freelist = 0;
 }
 
 static struct octnode *alloc_node(struct octree *tree, int lvl)
 {
 	struct octnode *n;
+	struct nodeblock *blk;
 
-	if(!(n = calloc(1, sizeof *n))) {
-		perror("failed to allocate octree node");
-		abort();
+	if(tree->freelist) {
+		n = tree->freelist;
+		tree->freelist = n->next;
+	} else {
+		if(!tree->blocks || tree->blk_used >= NODE_BLOCK_SIZE) {
+			if(!(blk = malloc(sizeof *blk))) {
+				perror("failed to allocate octree node block");
+				abort();
+			}
+			blk->next = tree->blocks;
+			tree->blocks = blk;
+			tree->blk_used = 0;
+		}
+		n = tree->blocks->nodes + tree->blk_used++;
 	}
+	memset(n, 0, sizeof *n);
 
 	n->lvl = lvl;
 	n->tree = tree;
 	n->palidx = -1;
 
 	if(lvl < tree->redlev) {
-		n->next = tree->redlist[lvl];
-		tree->redlist[lvl] = n;
+		n->seq = tree->redseq++;
+		heap_insert(tree->redheap + lvl, n);
 	} else {
 		n->leaf = 1;
 		tree->nleaves++;
@@ -244,43 +1616,28 @@ static struct octnode *alloc_node(struct octree *tree, int lvl)
 	return n;
 }
 
+/* only leaves and nodes still in the reducible heaps are ever freed individually,
+ * everything else goes away with the node blocks in destroy_octree
+ */
 static void free_node(struct octnode *n)
 {
-	struct octnode *prev, dummy;
-
-	dummy.next = n->tree->redlist[n->lvl];
-	prev = &dummy;
-	while(prev->next) {
-		if(prev->next == n) {
-			prev->next = n->next;
-			break;
-		}
-		prev = prev->next;
-	}
-	n->tree->redlist[n->lvl] = dummy.next;
+	struct octree *tree = n->tree;
 
 	if(n->leaf) {
-		n->tree->nleaves--;
-		assert(n->tree->nleaves >= 0);
+		tree->nleaves--;
+		assert(tree->nleaves >= 0);
+	} else {
+		heap_remove(tree->redheap + n->lvl, n);
 	}
-	free(n);
-}
-
-static void free_tree(struct octnode *n)
-{
-	int i;
-
-	if(!n) return;
 
-	for(i=0; i<8; i++) {
-		free_tree(n->sub[i]);
-	}
-	free_node(n);
+	n->next = tree->freelist;
+	tree->freelist = n;
 }
 
-static void add_color(struct octree *tree, int r, int g, int b, int nref)
+static void add_color(struct octree *tree, int r, int g, int b, int64_t nref)
 {
-	int i, idx, rr, gg, bb;
+	int i, idx;
+	int64_t rr, gg, bb;
 	struct octnode *n;
 
 	rr = r * nref;
@@ -295,6 +1652,7 @@ static void add_color(struct octree *tree, int r, int g, int b, int nref)
 
 	for(i=0; i<NUM_LEVELS; i++) {
 		if(n->leaf) break;
+		heap_update(tree->redheap + i, n);
 
 		idx = subidx(i, r, g, b);
 
@@ -313,32 +1671,109 @@ static void add_color(struct octree *tree, int r, int g, int b, int nref)
 
 static struct octnode *get_reducible(struct octree *tree)
 {
-	int best_nref;
-	struct octnode dummy, *n, *prev, *best_prev, *best = 0;
+	struct nodeheap *heap;
+	struct octnode *n;
 
 	while(tree->redlev >= 0) {
-		best_nref = INT_MAX;
-		best = 0;
-		dummy.next = tree->redlist[tree->redlev];
-		prev = &dummy;
-		while(prev->next) {
-			n = prev->next;
-			if(n->nref < best_nref) {
-				best = n;
-				best_nref = n->nref;
-				best_prev = prev;
-			}
-			prev = prev->next;
-		}
-		if(best) {
-			best_prev->next = best->next;
-			tree->redlist[tree->redlev] = dummy.next;
-			break;
+		heap = tree->redheap + tree->redlev;
+		if(heap->count > 0) {
+			n = heap->nodes[0];
+			heap_remove(heap, n);
+			return n;
 		}
 		tree->redlev--;
 	}
+	return 0;
+}
+
+/* heap order: fewest references first, and among equals the most recently
+ * inserted, which matches the order the old linear list scan picked them in
+ */
+static int heap_less(struct octnode *a, struct octnode *b)
+{
+	if(a->nref != b->nref) {
+		return a->nref < b->nref;
+	}
+	return a->seq > b->seq;
+}
+
+static void heap_set(struct nodeheap *heap, int idx, struct octnode *n)
+{
+	heap->nodes[idx] = n;
+	n->heapidx = idx;
+}
+
+static void sift_up(struct nodeheap *heap, int idx)
+{
+	int parent;
+	struct octnode *n = heap->nodes[idx];
+
+	while(idx > 0) {
+		parent = (idx - 1) >> 1;
+		if(!heap_less(n, heap->nodes[parent])) break;
+		heap_set(heap, idx, heap->nodes[parent]);
+		idx = parent;
+	}
+	heap_set(heap, idx, n);
+}
+
+static void sift_down(struct nodeheap *heap, int idx)
+{
+	int child;
+	struct octnode *n = heap->nodes[idx];
+
+	while((child = idx * 2 + 1) < heap->count) {
+		if(child + 1 < heap->count && heap_less(heap->nodes[child + 1], heap->nodes[child])) {
+			child++;
+		}
+		if(!heap_less(heap->nodes[child], n)) break;
+		heap_set(heap, idx, heap->nodes[child]);
+		idx = child;
+	}
+	heap_set(heap, idx, n);
+}
+
+static void heap_insert(struct nodeheap *heap, struct octnode *n)
+{
+	int newsz;
+	struct octnode **tmp;
+
+	if(heap->count >= heap->size) {
+		newsz = heap->size ? heap->size * 2 : 256;
+		if(!(tmp = realloc(heap->nodes, newsz * sizeof *heap->nodes))) {
+			perror("failed to resize reducible node heap");
+			abort();
+		}
+		heap->nodes = tmp;
+		heap->size = newsz;
+	}
+	heap_set(heap, heap->count++, n);
+	sift_up(heap, n->heapidx);
+}
+
+static void heap_remove(struct nodeheap *heap, struct octnode *n)
+{
+	int idx = n->heapidx;
+	struct octnode *last;
+
+	assert(idx >= 0 && idx < heap->count && heap->nodes[idx] == n);
+
+	last = heap->nodes[--heap->count];
+	if(last != n) {
+		heap_set(heap, idx, last);
+		if(idx > 0 && heap_less(last, heap->nodes[(idx - 1) >> 1])) {
+			sift_up(heap, idx);
+		} else {
+			sift_down(heap, idx);
+		}
+	}
+	n->heapidx = -1;
+}
 
-	return best;
+/* nref only ever grows, so an updated node can only sink */
+static void heap_update(struct nodeheap *heap, struct octnode *n)
+{
+	sift_down(heap, n->heapidx);
 }
 
 static void reduce_colors(struct octree *tree)
@@ -409,6 +1844,68 @@ static int lookup_color(struct octree *tree, int r, int g, int b)
 	return -1;
 }
 
+static int match_color_cb(void *cls, int r, int g, int b)
+{
+	return match_color(cls, r, g, b);
+}
+
+static int init_palmatch(struct palmatch *pm, struct octree *tree, struct cmapent *cmap, int ncolors)
+{
+	int res;
+	double t0;
+
+	pm->tree = tree;
+	pm->inv.idx = 0;
+
+	if(init_nearest(&pm->nn, quant_nearest, cmap, ncolors) == -1) {
+		return -1;
+	}
+	if(quant_lut_bits <= 0) {
+		return 0;
+	}
+
+	/* the sweep builds the exact nearest color table, an octree walk has to be
+	 * asked about each cell instead
+	 */
+	t0 = get_msec();
+	if(quant_nearest == NEAREST_OCTREE && tree) {
+		res = fill_invcmap(&pm->inv, quant_lut_bits, match_color_cb, pm);
+	} else {
+		res = build_invcmap(&pm->inv, cmap, ncolors, quant_lut_bits);
+	}
+	if(res == -1) {
+		return -1;
+	}
+	if(verbose) {
+		fprintf(stderr, "inverse colormap (%d^3): %.2f ms\n", 1 << quant_lut_bits,
+				get_msec() - t0);
+	}
+	return 0;
+}
+
+static void destroy_palmatch(struct palmatch *pm)
+{
+	destroy_invcmap(&pm->inv);
+}
+
+/* nearest color with the selected search method */
+static int match_color(struct palmatch *pm, int r, int g, int b)
+{
+	if(pm->nn.method == NEAREST_OCTREE && pm->tree) {
+		return lookup_color(pm->tree, r, g, b);
+	}
+	return nearest_color(&pm->nn, r, g, b);
+}
+
+/* nearest color through the inverse colormap if there is one */
+static int find_color(struct palmatch *pm, int r, int g, int b)
+{
+	if(pm->inv.idx) {
+		return INVCMAP_LOOKUP(&pm->inv, r, g, b);
+	}
+	return match_color(pm, r, g, b);
+}
+
 static int subidx(int bit, int r, int g, int b)
 {
 	assert(bit >= 0 && bit < NUM_LEVELS);
@@ -431,8 +1928,8 @@ static void print_tree(struct octnode *n, int lvl)
 	p = ptrbuf + strlen(ptrbuf) - 4;
 
 	if(n->nref) {
-		printf("+-(%d) %s: <%d %d %d> #%d", n->lvl, p, n->r / n->nref, n->g / n->nref,
-				n->b / n->nref, n->nref);
+		printf("+-(%d) %s: <%d %d %d> #%ld", n->lvl, p, (int)(n->r / n->nref),
+				(int)(n->g / n->nref), (int)(n->b / n->nref), (long)n->nref);
 	} else {
 		printf("+-(%d) %s: <- - -> #0", n->lvl, p);
 	}
@@ -0,0 +1,178 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "rawimg.h"
+
+#define RAW_BYTEORDER	0x01020304
+/* pixels start on a cache line boundary */
+#define RAW_DATA_ALIGN	64
+
+struct raw_header {
+	char magic[RAW_MAGIC_SIZE];
+	uint32_t byteorder;
+	uint32_t offset;		/* file offset of the pixels */
+	int32_t width, height;
+	int32_t bpp, nchan;
+	int32_t scansz;
+	int32_t cmap_ncolors;
+	struct cmapent cmap[256];
+};
+
+#define RAW_DATA_OFFS	\
+	((sizeof(struct raw_header) + RAW_DATA_ALIGN - 1) & ~(RAW_DATA_ALIGN - 1))
+
+int is_raw_image(FILE *fp)
+{
+	char magic[RAW_MAGIC_SIZE];
+	long pos = ftell(fp);
+	int res;
+
+	res = fread(magic, 1, RAW_MAGIC_SIZE, fp) == RAW_MAGIC_SIZE &&
+		memcmp(magic, RAW_MAGIC, RAW_MAGIC_SIZE) == 0;
+	fseek(fp, pos, SEEK_SET);
+	return res;
+}
+
+/* bpp and channel count combinations the rest of imgquant can handle, as
+ * loaded from PNG files or produced by -555
+ */
+static int valid_format(int bpp, int nchan)
+{
+	switch(nchan) {
+	case 1:
+		return bpp == 1 || bpp == 2 || bpp == 4 || bpp == 8 || bpp == 16;
+	case 2:
+		return bpp == 16 || bpp == 32;
+	case 3:
+		return bpp == 15 || bpp == 16 || bpp == 24 || bpp == 48;
+	case 4:
+		return bpp == 32 || bpp == 64;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int check_header(struct raw_header *hdr, size_t filesz)
+{
+	if(hdr->byteorder != RAW_BYTEORDER) {
+		return -1;
+	}
+	if(hdr->width <= 0 || hdr->height <= 0 || !valid_format(hdr->bpp, hdr->nchan)) {
+		return -1;
+	}
+	if(hdr->cmap_ncolors < 0 || hdr->cmap_ncolors > 256) {
+		return -1;
+	}
+	/* scanlines are not padded, which keeps 16/32bit pixels aligned */
+	if(hdr->scansz != ((int64_t)hdr->width * (hdr->bpp == 15 ? 16 : hdr->bpp) + 7) / 8) {
+		return -1;
+	}
+	if(hdr->offset < RAW_DATA_OFFS || hdr->offset % RAW_DATA_ALIGN != 0 || hdr->offset > filesz ||
+			(filesz - hdr->offset) / hdr->scansz < hdr->height) {
+		return -1;
+	}
+	return 0;
+}
+
+/* The pixels are used right where they are in the mapping, there's no decoding
+ * and no copying. The mapping is private, so whatever modifies the pixels in
+ * place gets its own copy of the pages it touches, and the file never changes.
+ */
+int load_raw_image(struct image *img, FILE *fp, const char *fname)
+{
+	struct stat st;
+	struct raw_header *hdr;
+	void *map;
+
+	if(fstat(fileno(fp), &st) == -1) {
+		fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(st.st_size < sizeof *hdr) {
+		fprintf(stderr, "%s: truncated raw image\n", fname);
+		return -1;
+	}
+
+	map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "%s: failed to map raw image: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	hdr = map;
+
+	if(check_header(hdr, st.st_size) == -1) {
+		fprintf(stderr, "%s: invalid or foreign byte order raw image\n", fname);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	img->width = hdr->width;
+	img->height = hdr->height;
+	img->bpp = hdr->bpp;
+	img->nchan = hdr->nchan;
+	img->scansz = img->pitch = hdr->scansz;
+	img->cmap_ncolors = hdr->cmap_ncolors;
+	memcpy(img->cmap, hdr->cmap, sizeof img->cmap);
+	img->pixels = (unsigned char*)map + hdr->offset;
+	img->mapping = map;
+	img->mapsz = st.st_size;
+	return 0;
+}
+
+int save_raw_image_file(struct image *img, FILE *fp)
+{
+	int i;
+	struct raw_header hdr;
+	static const char pad[RAW_DATA_ALIGN];
+	unsigned char *pptr = img->pixels;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, RAW_MAGIC, RAW_MAGIC_SIZE);
+	hdr.byteorder = RAW_BYTEORDER;
+	hdr.offset = RAW_DATA_OFFS;
+	hdr.width = img->width;
+	hdr.height = img->height;
+	hdr.bpp = img->bpp;
+	hdr.nchan = img->nchan;
+	hdr.scansz = img->scansz;
+	hdr.cmap_ncolors = img->cmap_ncolors;
+	memcpy(hdr.cmap, img->cmap, img->cmap_ncolors * sizeof *hdr.cmap);
+
+	if(fwrite(&hdr, sizeof hdr, 1, fp) < 1 ||
+			fwrite(pad, 1, RAW_DATA_OFFS - sizeof hdr, fp) < RAW_DATA_OFFS - sizeof hdr) {
+		fprintf(stderr, "failed to write raw image header\n");
+		return -1;
+	}
+
+	for(i=0; i<img->height; i++) {
+		if(fwrite(pptr, 1, img->scansz, fp) < img->scansz) {
+			fprintf(stderr, "failed to write raw image pixels\n");
+			return -1;
+		}
+		pptr += img->pitch;
+	}
+	return 0;
+}
@@ -0,0 +1,39 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef RAWIMG_H_
+#define RAWIMG_H_
+
+#include <stdio.h>
+#include "image.h"
+
+/* Uncompressed image container, for passing images between imgquant runs
+ * without decoding PNG every time. A header with the image format and the
+ * palette, followed by the pixels in memory order, with no padding between
+ * scanlines. Everything is in the byte order of the machine which wrote it.
+ */
+#define RAW_MAGIC		"IMGQRAW1"
+#define RAW_MAGIC_SIZE	8
+
+/* checks for the magic at the current file position, and seeks back */
+int is_raw_image(FILE *fp);
+
+/* maps the file copy-on-write, img->pixels points into the mapping */
+int load_raw_image(struct image *img, FILE *fp, const char *fname);
+int save_raw_image_file(struct image *img, FILE *fp);
+
+#endif	/* RAWIMG_H_ */
@@ -0,0 +1,177 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "thresh.h"
+
+#define BN_COUNT	(BLUE_NOISE_SIZE * BLUE_NOISE_SIZE)
+#define BN_MASK		(BLUE_NOISE_SIZE - 1)
+#define BN_SIGMA	1.5
+
+static void update_energy(float *energy, float *gauss, int pos, float sign);
+static int tightest_cluster(unsigned char *pat, float *energy);
+static int largest_void(unsigned char *pat, float *energy);
+
+static unsigned short *bnmask;
+
+/* interleaves the bits of x ^ y and y, least significant bits first, which
+ * gives the recursive Bayer pattern
+ */
+int bayer_rank(int x, int y, int bits)
+{
+	int i, rank = 0;
+
+	for(i=0; i<bits; i++) {
+		rank = (rank << 2) | ((((x >> i) ^ (y >> i)) & 1) << 1) | ((y >> i) & 1);
+	}
+	return rank;
+}
+
+/* Ulichney's void-and-cluster: start from a sparse random pattern, shuffle it
+ * until its minority pixels are evenly spread, then rank the pixels by
+ * removing the tightest clusters and filling the largest voids. Cluster and
+ * void are measured with a gaussian filter wrapping around the edges, which is
+ * what makes the mask tileable. The random pattern comes from a fixed seed, so
+ * the mask is always the same.
+ */
+const unsigned short *blue_noise_mask(void)
+{
+	int i, x, y, dx, dy, pos, rank, ones;
+	unsigned int seed = 1;
+	unsigned char *pat, *initpat;
+	float *energy, *initenergy, *gauss;
+
+	if(bnmask) return bnmask;
+
+	bnmask = malloc(BN_COUNT * sizeof *bnmask);
+	pat = malloc(BN_COUNT * 2);
+	energy = malloc(BN_COUNT * 3 * sizeof *energy);
+	if(!bnmask || !pat || !energy) {
+		fprintf(stderr, "failed to allocate blue noise mask\n");
+		free(bnmask);
+		free(pat);
+		free(energy);
+		bnmask = 0;
+		return 0;
+	}
+	initpat = pat + BN_COUNT;
+	initenergy = energy + BN_COUNT;
+	gauss = energy + BN_COUNT * 2;
+
+	for(y=0; y<BLUE_NOISE_SIZE; y++) {
+		dy = y < BLUE_NOISE_SIZE / 2 ? y : BLUE_NOISE_SIZE - y;
+		for(x=0; x<BLUE_NOISE_SIZE; x++) {
+			dx = x < BLUE_NOISE_SIZE / 2 ? x : BLUE_NOISE_SIZE - x;
+			gauss[(y << BLUE_NOISE_BITS) | x] = exp(-(dx * dx + dy * dy) / (2.0 * BN_SIGMA * BN_SIGMA));
+		}
+	}
+
+	/* initial pattern, a tenth of the pixels set */
+	memset(pat, 0, BN_COUNT);
+	memset(energy, 0, BN_COUNT * sizeof *energy);
+	ones = 0;
+	while(ones < BN_COUNT / 10) {
+		seed = seed * 1103515245 + 12345;
+		pos = (seed >> 8) & (BN_COUNT - 1);
+		if(!pat[pos]) {
+			pat[pos] = 1;
+			update_energy(energy, gauss, pos, 1.0f);
+			ones++;
+		}
+	}
+
+	/* move the pixel in the tightest cluster to the largest void, until it
+	 * would go right back where it came from
+	 */
+	for(i=0; i<BN_COUNT; i++) {
+		pos = tightest_cluster(pat, energy);
+		pat[pos] = 0;
+		update_energy(energy, gauss, pos, -1.0f);
+
+		x = largest_void(pat, energy);
+		pat[x] = 1;
+		update_energy(energy, gauss, x, 1.0f);
+		if(x == pos) break;
+	}
+	memcpy(initpat, pat, BN_COUNT);
+	memcpy(initenergy, energy, BN_COUNT * sizeof *energy);
+
+	/* ranks below the initial pattern: remove the tightest clusters */
+	for(rank=ones-1; rank>=0; rank--) {
+		pos = tightest_cluster(pat, energy);
+		pat[pos] = 0;
+		update_energy(energy, gauss, pos, -1.0f);
+		bnmask[pos] = rank;
+	}
+
+	/* the rest: fill the largest voids */
+	memcpy(pat, initpat, BN_COUNT);
+	memcpy(energy, initenergy, BN_COUNT * sizeof *energy);
+	for(rank=ones; rank<BN_COUNT; rank++) {
+		pos = largest_void(pat, energy);
+		pat[pos] = 1;
+		update_energy(energy, gauss, pos, 1.0f);
+		bnmask[pos] = rank;
+	}
+
+	free(pat);
+	free(energy);
+	return bnmask;
+}
+
+static void update_energy(float *energy, float *gauss, int pos, float sign)
+{
+	int x, y, px, py;
+	float *grow;
+
+	px = pos & BN_MASK;
+	py = pos >> BLUE_NOISE_BITS;
+
+	for(y=0; y<BLUE_NOISE_SIZE; y++) {
+		grow = gauss + (((y - py) & BN_MASK) << BLUE_NOISE_BITS);
+		for(x=0; x<BLUE_NOISE_SIZE; x++) {
+			*energy++ += sign * grow[(x - px) & BN_MASK];
+		}
+	}
+}
+
+static int tightest_cluster(unsigned char *pat, float *energy)
+{
+	int i, best = -1;
+
+	for(i=0; i<BN_COUNT; i++) {
+		if(pat[i] && (best < 0 || energy[i] > energy[best])) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+static int largest_void(unsigned char *pat, float *energy)
+{
+	int i, best = -1;
+
+	for(i=0; i<BN_COUNT; i++) {
+		if(!pat[i] && (best < 0 || energy[i] < energy[best])) {
+			best = i;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,36 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef THRESH_H_
+#define THRESH_H_
+
+/* threshold masks for ordered dithering. Masks are square, with a power of two
+ * side, and hold the rank of each position: 0 to side^2 - 1.
+ */
+
+/* Bayer matrix, bits: log2 of the side (1 to 3 for 2x2 to 8x8) */
+int bayer_rank(int x, int y, int bits);
+
+#define BLUE_NOISE_BITS		6
+#define BLUE_NOISE_SIZE		(1 << BLUE_NOISE_BITS)
+
+/* tileable 64x64 blue noise mask, generated by void-and-cluster on first use.
+ * Returns null if it can't be allocated.
+ */
+const unsigned short *blue_noise_mask(void);
+
+#endif	/* THRESH_H_ */
@@ -0,0 +1,537 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tilemerge.h"
+#include "tpool.h"
+#include "util.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TILEMERGE_X86
+#include <immintrin.h>
+#endif
+
+/* Comparing every pair of tiles is out of the question for tens of thousands
+ * of tiles. Instead the tiles are sorted by their projection on a few random
+ * directions, and only tiles close together in one of those orders are
+ * considered for merging (locality sensitive hashing, in effect).
+ */
+#define NPROJ		16
+/* neighbours of every tile in each order, doubled if that's not enough */
+#define INIT_WINDOW	4
+/* with this few groups left, they're all compared with each other. The random
+ * orders become unreliable at that point, as the groups are far more similar
+ * than random tiles.
+ */
+#define EXACT_SEARCH	2048
+/* candidate pairs kept per tile, the closest of those found */
+#define MAX_NEIGHBOURS	8
+/* tiles per job in the parallel passes */
+#define JOB_SIZE	1024
+
+typedef uint32_t (*tile_dist_func)(const unsigned char *a, const unsigned char *b, int n);
+
+struct edge {
+	double cost;
+	int a, b;
+};
+
+struct sortkey {
+	float key;
+	int tile;
+};
+
+struct merge_job {
+	struct image *img;
+	int th, ntiles;
+	int dim;				/* RGB of every pixel, padded to a multiple of 32 */
+	unsigned char *feat;	/* dim bytes per tile */
+	float *proj;			/* NPROJ direction vectors */
+	float *keys;			/* NPROJ projections per tile */
+	int *weight;			/* tilemap entries using every group */
+
+	/* candidate search, see neighbour_job */
+	int *reps, nreps;		/* remaining groups */
+	int *order, *pos;		/* groups sorted by each projection, and where they are */
+	int nproj, window, maxnb;
+	struct edge *edges;		/* maxnb per group */
+	int nedges;
+	tile_dist_func dist;
+};
+
+static uint32_t dist_scalar(const unsigned char *a, const unsigned char *b, int n);
+#ifdef TILEMERGE_X86
+static uint32_t dist_sse2(const unsigned char *a, const unsigned char *b, int n);
+static uint32_t dist_avx2(const unsigned char *a, const unsigned char *b, int n);
+#endif
+static void feature_job(void *cls, int job);
+static void neighbour_job(void *cls, int job);
+static double merge_cost(struct merge_job *mj, int a, int b);
+static int find_group(int *parent, int x);
+static int edge_less(struct edge *a, struct edge *b);
+static void heap_push(struct edge *heap, int *count, struct edge *e);
+static void heap_pop(struct edge *heap, int *count, struct edge *e);
+static void heap_sift_down(struct edge *heap, int count, int i);
+static int cmp_sortkey(const void *a, const void *b);
+
+int merge_tiles(struct tilemap *tmap, struct image *img, int th, int maxtiles)
+{
+	int i, k, p, ntiles, ngroups, nreps, target, window, maxnb, exact, nheap, njobs, a, b, tmp;
+	int tw = img->width;
+	unsigned int seed;
+	int *parent, *reps, *newid, *map;
+	struct sortkey *order;
+	struct edge e;
+	struct merge_job mj;
+	size_t tilesz;
+	unsigned char *pixels;
+	double t0 = get_msec();
+
+	ntiles = img->height / th;
+	if(ntiles <= maxtiles) {
+		return ntiles;
+	}
+	if(img->bpp < 4) {
+		fprintf(stderr, "merge_tiles: not implemented for %d bpp\n", img->bpp);
+		return -1;
+	}
+
+	memset(&mj, 0, sizeof mj);
+	mj.img = img;
+	mj.th = th;
+	mj.ntiles = ntiles;
+	mj.dim = (tw * th * 3 + 31) & ~31;
+
+	mj.dist = dist_scalar;
+#ifdef TILEMERGE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		mj.dist = dist_avx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		mj.dist = dist_sse2;
+	}
+#endif
+
+	mj.feat = calloc(ntiles, mj.dim);
+	mj.proj = malloc(NPROJ * mj.dim * sizeof *mj.proj);
+	mj.keys = malloc(ntiles * NPROJ * sizeof *mj.keys);
+	mj.weight = calloc(ntiles, sizeof *mj.weight);
+	mj.order = malloc(ntiles * NPROJ * 2 * sizeof *mj.order);
+	parent = malloc(ntiles * 2 * sizeof *parent);
+	order = malloc(ntiles * sizeof *order);
+	if(!mj.feat || !mj.proj || !mj.keys || !mj.weight || !mj.order || !parent || !order) {
+		fprintf(stderr, "merge_tiles: failed to allocate memory for %d tiles\n", ntiles);
+		free(mj.feat);
+		free(mj.proj);
+		free(mj.keys);
+		free(mj.weight);
+		free(mj.order);
+		free(parent);
+		free(order);
+		return -1;
+	}
+	reps = parent + ntiles;
+	mj.reps = reps;
+	mj.pos = mj.order + ntiles * NPROJ;
+
+	/* fixed seed, the result must only depend on the input */
+	seed = 0x2545f491;
+	for(i=0; i<NPROJ * mj.dim; i++) {
+		seed = seed * 1103515245 + 12345;
+		mj.proj[i] = (float)((seed >> 8) & 0xffff) / 32768.0f - 1.0f;
+	}
+
+	for(i=0; i<tmap->width * tmap->height; i++) {
+		mj.weight[TILE_INDEX(tmap->map[i])]++;
+	}
+	for(i=0; i<ntiles; i++) {
+		parent[i] = i;
+		/* tiles the tilemap doesn't use still weigh something */
+		if(!mj.weight[i]) mj.weight[i] = 1;
+	}
+
+	njobs = (ntiles + JOB_SIZE - 1) / JOB_SIZE;
+	tpool_run(tpool, njobs, feature_job, &mj);
+
+	ngroups = ntiles;
+	window = INIT_WINDOW;
+	maxnb = MAX_NEIGHBOURS;
+	while(ngroups > maxtiles) {
+		nreps = 0;
+		for(i=0; i<ntiles; i++) {
+			if(parent[i] == i) reps[nreps++] = i;
+		}
+
+		/* with a window spanning all groups, one order covers every pair. If
+		 * the closest ones aren't enough, more are kept, up to all of them,
+		 * which is sure to reach the budget.
+		 */
+		exact = nreps <= EXACT_SEARCH || window >= nreps - 1;
+		if(exact) {
+			mj.nproj = 1;
+			mj.window = nreps - 1;
+			mj.maxnb = maxnb < nreps - 1 ? maxnb : nreps - 1;
+		} else {
+			mj.nproj = NPROJ;
+			mj.window = window;
+			mj.maxnb = MAX_NEIGHBOURS;
+		}
+		mj.nreps = nreps;
+
+		free(mj.edges);
+		if(!(mj.edges = malloc((size_t)nreps * mj.maxnb * sizeof *mj.edges))) {
+			fprintf(stderr, "merge_tiles: failed to allocate candidate pairs\n");
+			free(mj.feat);
+			free(mj.proj);
+			free(mj.keys);
+			free(mj.weight);
+			free(mj.order);
+			free(parent);
+			free(order);
+			return -1;
+		}
+
+		for(p=0; p<mj.nproj; p++) {
+			for(i=0; i<nreps; i++) {
+				order[i].key = mj.keys[reps[i] * NPROJ + p];
+				order[i].tile = reps[i];
+			}
+			qsort(order, nreps, sizeof *order, cmp_sortkey);
+
+			for(i=0; i<nreps; i++) {
+				mj.order[p * nreps + i] = order[i].tile;
+				mj.pos[p * ntiles + order[i].tile] = i;
+			}
+		}
+
+		njobs = (nreps + JOB_SIZE - 1) / JOB_SIZE;
+		tpool_run(tpool, njobs, neighbour_job, &mj);
+
+		mj.nedges = 0;
+		for(i=0; i<nreps * mj.maxnb; i++) {
+			if(mj.edges[i].a >= 0) {
+				mj.edges[mj.nedges++] = mj.edges[i];
+			}
+		}
+
+		/* the edges array becomes the heap, in place */
+		nheap = mj.nedges;
+		for(i=nheap / 2 - 1; i>=0; i--) {
+			heap_sift_down(mj.edges, nheap, i);
+		}
+
+		/* Merge the cheapest pair first. Costs only go up as groups grow, so
+		 * popped pairs whose cost went up since they were pushed go back in
+		 * with the new cost. Pairs from groups which were merged into others
+		 * stand for the groups they ended up in.
+		 * The candidates only stay relevant for so long: once half the groups
+		 * are gone, the next round looks for new ones among those left.
+		 */
+		target = nreps / 2 > maxtiles ? nreps / 2 : maxtiles;
+		while(ngroups > target && nheap > 0) {
+			heap_pop(mj.edges, &nheap, &e);
+			a = find_group(parent, e.a);
+			b = find_group(parent, e.b);
+			if(a == b) continue;
+
+			e.a = a < b ? a : b;
+			e.b = a < b ? b : a;
+			e.cost = merge_cost(&mj, a, b);
+			if(nheap > 0 && e.cost > mj.edges[0].cost) {
+				heap_push(mj.edges, &nheap, &e);
+				continue;
+			}
+
+			/* the most used tile represents the group */
+			if(mj.weight[b] > mj.weight[a] || (mj.weight[b] == mj.weight[a] && b < a)) {
+				tmp = a;
+				a = b;
+				b = tmp;
+			}
+			parent[b] = a;
+			mj.weight[a] += mj.weight[b];
+			ngroups--;
+		}
+
+		/* ran out of candidates, look further next time */
+		if(ngroups > target) {
+			if(exact) {
+				maxnb *= 2;
+			} else {
+				window *= 2;
+			}
+		}
+	}
+	free(mj.edges);
+
+	/* renumber the remaining tiles in order, and move them down */
+	newid = reps;
+	k = 0;
+	tilesz = (size_t)img->pitch * th;
+	pixels = img->pixels;
+	for(i=0; i<ntiles; i++) {
+		if(find_group(parent, i) == i) {
+			newid[i] = k;
+			if(k < i) {
+				memcpy(pixels + k * tilesz, pixels + i * tilesz, tilesz);
+			}
+			k++;
+		}
+	}
+	map = tmap->map;
+	for(i=0; i<tmap->width * tmap->height; i++) {
+		map[i] = newid[find_group(parent, TILE_INDEX(map[i]))] | (map[i] & (TILE_HFLIP | TILE_VFLIP));
+	}
+	img->height = ngroups * th;
+
+	if(verbose) {
+		fprintf(stderr, "merged %d tiles down to %d\n", ntiles, ngroups);
+	}
+	VERBOSE_TIME(t0, "tile merging");
+
+	free(mj.feat);
+	free(mj.proj);
+	free(mj.keys);
+	free(mj.weight);
+	free(mj.order);
+	free(parent);
+	free(order);
+	return ngroups;
+}
+
+/* RGB pixels of a range of tiles, and their projections */
+static void feature_job(void *cls, int job)
+{
+	int i, j, p, y, t0, t1;
+	struct merge_job *mj = cls;
+	struct image *img = mj->img;
+	unsigned char *feat;
+	float *proj, key;
+
+	t0 = job * JOB_SIZE;
+	t1 = t0 + JOB_SIZE < mj->ntiles ? t0 + JOB_SIZE : mj->ntiles;
+
+	for(i=t0; i<t1; i++) {
+		feat = mj->feat + (size_t)i * mj->dim;
+		for(y=0; y<mj->th; y++) {
+			get_row_rgb(img, i * mj->th + y, 0, img->width, feat + y * img->width * 3);
+		}
+
+		for(p=0; p<NPROJ; p++) {
+			proj = mj->proj + p * mj->dim;
+			key = 0.0f;
+			for(j=0; j<mj->dim; j++) {
+				key += feat[j] * proj[j];
+			}
+			mj->keys[i * NPROJ + p] = key;
+		}
+	}
+}
+
+/* Finds the closest groups to a range of groups, among the window groups on
+ * either side of them in every order, and writes the maxnb cheapest pairs
+ * for each. Unused slots get a = -1.
+ */
+static void neighbour_job(void *cls, int job)
+{
+	int i, j, k, p, d, r, q, n, pos, worst, i0, i1;
+	struct merge_job *mj = cls;
+	struct edge *best, cand;
+
+	i0 = job * JOB_SIZE;
+	i1 = i0 + JOB_SIZE < mj->nreps ? i0 + JOB_SIZE : mj->nreps;
+
+	for(i=i0; i<i1; i++) {
+		r = mj->reps[i];
+		best = mj->edges + (size_t)i * mj->maxnb;
+		n = 0;
+		worst = 0;
+
+		for(p=0; p<mj->nproj; p++) {
+			pos = mj->pos[p * mj->ntiles + r];
+			for(d=-mj->window; d<=mj->window; d++) {
+				if(!d || pos + d < 0 || pos + d >= mj->nreps) continue;
+				q = mj->order[p * mj->nreps + pos + d];
+				cand.a = r < q ? r : q;
+				cand.b = r < q ? q : r;
+
+				/* close in more than one order */
+				if(mj->nproj > 1) {
+					for(k=0; k<n; k++) {
+						if(best[k].a == cand.a && best[k].b == cand.b) break;
+					}
+					if(k < n) continue;
+				}
+
+				cand.cost = merge_cost(mj, r, q);
+				if(n < mj->maxnb) {
+					best[n++] = cand;
+					if(n == mj->maxnb) {
+						for(j=1; j<n; j++) {
+							if(edge_less(best + worst, best + j)) worst = j;
+						}
+					}
+				} else if(edge_less(&cand, best + worst)) {
+					best[worst] = cand;
+					for(j=0; j<n; j++) {
+						if(edge_less(best + worst, best + j)) worst = j;
+					}
+				}
+			}
+		}
+
+		for(k=n; k<mj->maxnb; k++) {
+			best[k].a = -1;
+		}
+	}
+}
+
+/* Ward's criterion: the distance of the representative tiles, scaled by the
+ * harmonic mean of the group weights, so rarely used tiles merge first
+ */
+static double merge_cost(struct merge_job *mj, int a, int b)
+{
+	double wa = mj->weight[a];
+	double wb = mj->weight[b];
+	uint32_t d = mj->dist(mj->feat + (size_t)a * mj->dim, mj->feat + (size_t)b * mj->dim, mj->dim);
+
+	return wa * wb / (wa + wb) * d;
+}
+
+static int find_group(int *parent, int x)
+{
+	while(parent[x] != x) {
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+/* ties are broken by tile number, to keep the merge order deterministic */
+static int edge_less(struct edge *a, struct edge *b)
+{
+	if(a->cost != b->cost) return a->cost < b->cost;
+	if(a->a != b->a) return a->a < b->a;
+	return a->b < b->b;
+}
+
+static void heap_push(struct edge *heap, int *count, struct edge *e)
+{
+	int i = (*count)++;
+	int up;
+
+	while(i > 0) {
+		up = (i - 1) / 2;
+		if(!edge_less(e, heap + up)) break;
+		heap[i] = heap[up];
+		i = up;
+	}
+	heap[i] = *e;
+}
+
+static void heap_pop(struct edge *heap, int *count, struct edge *e)
+{
+	*e = heap[0];
+	if(--(*count) > 0) {
+		heap[0] = heap[*count];
+		heap_sift_down(heap, *count, 0);
+	}
+}
+
+static void heap_sift_down(struct edge *heap, int count, int i)
+{
+	int child;
+	struct edge e = heap[i];
+
+	while((child = i * 2 + 1) < count) {
+		if(child + 1 < count && edge_less(heap + child + 1, heap + child)) {
+			child++;
+		}
+		if(!edge_less(heap + child, &e)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+static int cmp_sortkey(const void *a, const void *b)
+{
+	const struct sortkey *ka = a;
+	const struct sortkey *kb = b;
+
+	if(ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+	return ka->tile - kb->tile;
+}
+
+/* sum of squared differences, n is a multiple of 32 */
+static uint32_t dist_scalar(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i, d;
+	uint32_t sum = 0;
+
+	for(i=0; i<n; i++) {
+		d = a[i] - b[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+#ifdef TILEMERGE_X86
+__attribute__((target("sse2")))
+static uint32_t dist_sse2(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i;
+	__m128i va, vb, lo, hi, zero, sum;
+	uint32_t buf[4];
+
+	zero = _mm_setzero_si128();
+	sum = zero;
+	for(i=0; i<n; i+=16) {
+		va = _mm_loadu_si128((const __m128i*)(a + i));
+		vb = _mm_loadu_si128((const __m128i*)(b + i));
+		lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+		hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(lo, lo));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(hi, hi));
+	}
+
+	_mm_storeu_si128((__m128i*)buf, sum);
+	return buf[0] + buf[1] + buf[2] + buf[3];
+}
+
+__attribute__((target("avx2")))
+static uint32_t dist_avx2(const unsigned char *a, const unsigned char *b, int n)
+{
+	int i;
+	__m256i va, vb, d, sum;
+	uint32_t buf[8];
+
+	sum = _mm256_setzero_si256();
+	for(i=0; i<n; i+=16) {
+		va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+		vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+		d = _mm256_sub_epi16(va, vb);
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(d, d));
+	}
+
+	_mm256_storeu_si256((__m256i*)buf, sum);
+	return buf[0] + buf[1] + buf[2] + buf[3] + buf[4] + buf[5] + buf[6] + buf[7];
+}
+#endif	/* TILEMERGE_X86 */
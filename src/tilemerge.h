@@ -0,0 +1,34 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TILEMERGE_H_
+#define TILEMERGE_H_
+
+#include "image.h"
+#include "tiles.h"
+
+/* Lossy tile merging, for fitting a tile budget after dedup. Reduces the tiles
+ * of a tile strip (th scanlines each) to maxtiles, by repeatedly merging the
+ * two most similar groups of tiles, as measured by the squared RGB difference
+ * of their pixels, weighted by how often they're used. The most used tile of
+ * every group is kept, and tilemap entries are redirected to it.
+ *
+ * Returns the new number of tiles, or -1 on failure.
+ */
+int merge_tiles(struct tilemap *tmap, struct image *img, int th, int maxtiles);
+
+#endif	/* TILEMERGE_H_ */
@@ -21,119 +21,643 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include "tiles.h"
 #include "image.h"
+#include "tpool.h"
+#include "tilemerge.h"
 
-static int matchtile(struct image *img, int toffs, int th);
+#define TIDX_INIT_SIZE	1024
+/* don't bother the thread pool with moving fewer tiles than this per job */
+#define MIN_MOVE_TILES	256
+/* per job scratch blocks start on cache line boundaries */
+#define SCRATCH_ALIGN	64
 
-int img2tiles(struct tilemap *tmap, struct image *img, int tw, int th, int dedup)
+/* hash table of the unique tiles emitted so far, open addressing with linear
+ * probing, same as the color histogram
+ */
+struct tile_index {
+	uint64_t *hash;
+	int *tile;		/* tile number, -1 for empty slots */
+	int size, count;
+	int tilesz;		/* bytes per tile */
+
+	/* matching flipped tiles: the flipped variants of the tile being looked
+	 * up, H, V, and HV. The index is keyed by a canonical hash, the lowest
+	 * hash of the four variants, which is the same for all of them.
+	 */
+	int flip;
+	int tw, th, pitch, bpp;
+	unsigned char *var[3];
+};
+
+/* shared state of the img2tiles passes */
+struct slice_job {
+	struct image *img;		/* tile strip */
+	struct image *src;		/* original image */
+	int th, xtiles, ytiles;
+	size_t tilesz;
+	int inplace;
+	int nbands, bandrows;	/* phase 1: jobs of bandrows rows of tiles */
+	unsigned char *scratch;
+	size_t scratchsz;		/* per job */
+
+	/* dedup only */
+	struct tile_index *tidx;
+	uint64_t *hash;			/* hash key of every tile */
+	int *upos;				/* original place of every unique tile */
+	int u0, ucount, umove;	/* phase 3: tiles [u0, u0 + ucount), umove per job */
+};
+
+static const char *tmap_format_names[] = {"index", "md", "snes", "gba"};
+
+static int init_tile_index(struct tile_index *tidx, struct image *img, int th, int flip);
+static void destroy_tile_index(struct tile_index *tidx);
+static uint64_t tile_key(struct tile_index *tidx, const unsigned char *tile, unsigned char *flipbuf);
+static int matchtile(struct tile_index *tidx, struct image *img, int t, uint64_t hash,
+		const int *upos, int newid);
+static void slice_band(void *cls, int job);
+static void move_tiles(void *cls, int job);
+static void gather_tile(struct image *img, int toffs, int th, struct image *src, int x, int y,
+		unsigned int *row);
+
+/* Slices the image into tw x th tiles, stacked vertically in a tw pixels wide
+ * strip, in three passes:
+ *  1. bands of tiles are gathered into the strip in scan order and hashed, in
+ *     parallel. When the image is a whole number of tiles across and down, the
+ *     strip takes exactly the space of the image, and it's built in place:
+ *     every band of tiles lands in the bytes of its own source band, so only
+ *     the band being sliced needs a copy. Otherwise the strip is a new buffer.
+ *  2. for dedup, the tiles are looked up in scan order, and unique tiles are
+ *     numbered in the order they first appear.
+ *  3. the unique tiles are moved down to their final place in parallel.
+ * Then, with a tile budget, similar tiles are merged until it's met.
+ * The result is the same regardless of the number of threads.
+ */
+int img2tiles(struct tilemap *tmap, struct image *img, int tw, int th, int dedup, int maxtiles)
 {
-	int i, j, x, y, tx, ty, tileoffs, xtiles, ytiles, ntiles, tileno, tid;
-	struct image orig;
-	unsigned int pix;
+	int i, t, bits, tpitch, xtiles, ytiles, ntiles, nuniq, tid, njobs, res = 0;
+	size_t tilesz, scratchsz;
+	struct image src;
+	struct slice_job sj;
+	struct tile_index tidx;
+	struct tilemap lmap;
+	unsigned char *strip;
+	void *tmp;
 
-	if(alloc_image(&orig, img->width, img->height, img->bpp) == -1) {
-		fprintf(stderr, "img2tiles: failed to allocate temporary image\n");
-		return -1;
+	/* merging needs to know how often each tile is used */
+	if(!tmap && dedup && maxtiles > 0) {
+		tmap = &lmap;
 	}
-	memcpy(orig.pixels, img->pixels, img->scansz * img->height);
 
 	xtiles = (img->width + tw - 1) / tw;
 	ytiles = (img->height + th - 1) / th;
 	ntiles = xtiles * ytiles;
 
-	img->width = tw;
-	img->height = ntiles * th;
-	img->pitch = img->scansz = tw * img->bpp / 8;
+	bits = img->bpp == 15 ? 16 : img->bpp;
+	tpitch = (tw * bits + 7) / 8;
+	tilesz = (size_t)tpitch * th;
+
+	memset(&sj, 0, sizeof sj);
+	sj.th = th;
+	sj.tilesz = tilesz;
+	sj.xtiles = xtiles;
+	sj.ytiles = ytiles;
+	sj.inplace = img->width % tw == 0 && img->height % th == 0 && (tw * bits) % 8 == 0 &&
+		xtiles * tpitch == img->pitch;
+
+	sj.nbands = tpool_num_threads(tpool) * 4;
+	if(sj.nbands > ytiles) sj.nbands = ytiles;
+	sj.bandrows = (ytiles + sj.nbands - 1) / sj.nbands;
+	sj.nbands = (ytiles + sj.bandrows - 1) / sj.bandrows;
+
+	/* per job: tile row buffer, a copy of the band for in-place slicing, and
+	 * a flipped tile for hashing
+	 */
+	scratchsz = tw * sizeof(unsigned int);
+	if(sj.inplace) scratchsz += (size_t)img->pitch * th;
+	if(dedup == DEDUP_FLIP) scratchsz += tilesz;
+	/* keeps the row buffer of every job aligned, and the jobs off each
+	 * other's cache lines
+	 */
+	scratchsz = (scratchsz + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+	sj.scratchsz = scratchsz;
+
+	if(!(sj.scratch = malloc(sj.nbands * scratchsz))) {
+		fprintf(stderr, "img2tiles: failed to allocate scratch buffers\n");
+		return -1;
+	}
+
+	if(sj.inplace) {
+		strip = img->pixels;
+	} else {
+		if(!(strip = malloc(ntiles * tilesz))) {
+			fprintf(stderr, "img2tiles: failed to allocate tile strip (%d tiles)\n", ntiles);
+			free(sj.scratch);
+			return -1;
+		}
+	}
 
 	if(tmap) {
 		tmap->width = xtiles;
 		tmap->height = ytiles;
 		if(!(tmap->map = malloc(ntiles * sizeof *tmap->map))) {
 			fprintf(stderr, "failed to allocate tilemap\n");
-			free(orig.pixels);
+			if(!sj.inplace) free(strip);
+			free(sj.scratch);
 			return -1;
 		}
 	}
 
-	tileno = 0;
-	tileoffs = 0;
-	y = 0;
-	for(i=0; i<ytiles; i++) {
-		x = 0;
-		for(j=0; j<xtiles; j++) {
-			for(ty=0; ty<th; ty++) {
-				for(tx=0; tx<tw; tx++) {
-					pix = get_pixel(&orig, x + tx, y + ty);
-					put_pixel(img, tx, ty + tileoffs, pix);
-				}
+	if(dedup) {
+		if(!(sj.hash = malloc(ntiles * (sizeof *sj.hash + sizeof *sj.upos)))) {
+			fprintf(stderr, "img2tiles: failed to allocate tile hashes\n");
+			if(tmap) free(tmap->map);
+			if(!sj.inplace) free(strip);
+			free(sj.scratch);
+			return -1;
+		}
+		sj.upos = (int*)(sj.hash + ntiles);
+	}
+
+	/* src keeps the original pixels, img becomes the tile strip */
+	src = *img;
+	img->pixels = strip;
+	img->width = tw;
+	img->height = ntiles * th;
+	img->pitch = img->scansz = tpitch;
+	if(!sj.inplace) {
+		img->mapping = 0;
+		img->mapsz = 0;
+	}
+	sj.img = img;
+	sj.src = &src;
+
+	if(dedup) {
+		if(init_tile_index(&tidx, img, th, dedup == DEDUP_FLIP) == -1) {
+			*img = src;
+			free(sj.hash);
+			if(tmap) free(tmap->map);
+			if(!sj.inplace) free(strip);
+			free(sj.scratch);
+			return -1;
+		}
+		sj.tidx = &tidx;
+	}
+
+	tpool_run(tpool, sj.nbands, slice_band, &sj);
+
+	if(!dedup) {
+		if(tmap) {
+			for(i=0; i<ntiles; i++) {
+				tmap->map[i] = i;
 			}
+		}
+	} else {
+		nuniq = 0;
+		for(t=0; t<ntiles; t++) {
+			if((tid = matchtile(&tidx, img, t, sj.hash[t], sj.upos, nuniq)) == -1) {
+				tid = nuniq;
+				sj.upos[nuniq++] = t;
+			}
+			if(tmap) {
+				tmap->map[t] = tid;
+			}
+		}
+		destroy_tile_index(&tidx);
 
-			if(dedup) {
-				if((tid = matchtile(img, tileoffs, th)) == -1) {
-					if(tmap) {
-						tmap->map[tileno++] = tileoffs / th;
-					}
-					tileoffs += th;	/* destination Y offset, inc by th for every tile */
-				} else {
-					if(tmap) {
-						tmap->map[tileno++] = tid;
-					}
-				}
-			} else {
-				tileoffs += th;	/* destination Y offset, inc by th for every tile */
+		/* Tile u moves down from upos[u], and the gap upos[u] - u never
+		 * shrinks. So in a run of as many tiles as the gap at its start, none
+		 * of them is moved over the original place of another, and the run can
+		 * be moved in parallel.
+		 */
+		i = 0;
+		while(i < nuniq && sj.upos[i] == i) i++;
+		while(i < nuniq) {
+			sj.u0 = i;
+			sj.ucount = sj.upos[i] - i;
+			if(sj.ucount > nuniq - i) sj.ucount = nuniq - i;
+
+			njobs = tpool_num_threads(tpool) * 4;
+			if(sj.ucount < MIN_MOVE_TILES * njobs) {
+				njobs = (sj.ucount + MIN_MOVE_TILES - 1) / MIN_MOVE_TILES;
 			}
-			x += tw;
+			sj.umove = (sj.ucount + njobs - 1) / njobs;
+			tpool_run(njobs > 1 ? tpool : 0, njobs, move_tiles, &sj);
+			i += sj.ucount;
+		}
+
+		img->height = nuniq * th;
+		free(sj.hash);
+
+		if(maxtiles > 0 && merge_tiles(tmap, img, th, maxtiles) == -1) {
+			fprintf(stderr, "img2tiles: failed to merge tiles down to %d\n", maxtiles);
+			res = -1;
+		}
+
+		/* give back the space of the duplicates */
+		if(!img->mapping && (tmp = realloc(img->pixels, img->height * tpitch))) {
+			img->pixels = tmp;
 		}
-		y += th;
 	}
 
-	if(dedup) {
-		putchar('\n');
-		img->height = tileoffs;
+	if(!sj.inplace) {
+		free_pixels(&src);
+	}
+	if(tmap == &lmap) {
+		free(lmap.map);
+	}
+	free(sj.scratch);
+	return res;
+}
+
+/* phase 1 job: gathers and hashes the tiles of a band of tile rows */
+static void slice_band(void *cls, int job)
+{
+	int i, j, t, y, y0, y1;
+	struct slice_job *sj = cls;
+	struct image *img = sj->img;
+	struct image band = *sj->src;
+	unsigned char *scratch, *bandpix, *flipbuf;
+	unsigned int *row;
+
+	y0 = job * sj->bandrows;
+	y1 = y0 + sj->bandrows < sj->ytiles ? y0 + sj->bandrows : sj->ytiles;
+
+	scratch = sj->scratch + job * sj->scratchsz;
+	row = (unsigned int*)scratch;
+	bandpix = scratch + img->width * sizeof *row;
+	flipbuf = sj->inplace ? bandpix + sj->src->pitch * sj->th : bandpix;
+
+	for(i=y0; i<y1; i++) {
+		y = i * sj->th;
+		if(sj->inplace) {
+			memcpy(bandpix, (unsigned char*)sj->src->pixels + y * sj->src->pitch,
+					sj->src->pitch * sj->th);
+			band.pixels = bandpix;
+			band.height = sj->th;
+			y = 0;
+		}
+
+		for(j=0; j<sj->xtiles; j++) {
+			t = i * sj->xtiles + j;
+			gather_tile(img, t * sj->th, sj->th, &band, j * img->width, y, row);
+
+			if(sj->hash) {
+				sj->hash[t] = tile_key(sj->tidx, (unsigned char*)img->pixels + t * sj->tilesz,
+						flipbuf);
+			}
+		}
+	}
+}
+
+/* phase 3 job: moves unique tiles to their final place */
+static void move_tiles(void *cls, int job)
+{
+	int i, u0, u1;
+	struct slice_job *sj = cls;
+	unsigned char *pixels = sj->img->pixels;
+	size_t tilesz = sj->tilesz;
+
+	u0 = sj->u0 + job * sj->umove;
+	u1 = u0 + sj->umove < sj->u0 + sj->ucount ? u0 + sj->umove : sj->u0 + sj->ucount;
+
+	for(i=u0; i<u1; i++) {
+		memcpy(pixels + i * tilesz, pixels + sj->upos[i] * tilesz, tilesz);
+	}
+}
+
+/* Copies the tile at x,y of src to scanline toffs of the tile strip. Tiles a
+ * whole number of bytes wide are copied a row span at a time, others a pixel
+ * at a time. Parts of the tile past the edges of the image are zeroed.
+ */
+static void gather_tile(struct image *img, int toffs, int th, struct image *src, int x, int y,
+		unsigned int *row)
+{
+	int i, w, h, bits, nbytes, tail;
+	unsigned char *dest, *sptr;
+
+	w = src->width - x < img->width ? src->width - x : img->width;
+	h = src->height - y < th ? src->height - y : th;
+	dest = (unsigned char*)img->pixels + toffs * img->pitch;
+	bits = img->bpp == 15 ? 16 : img->bpp;
+
+	if((img->width * bits) % 8) {
+		memset(dest, 0, img->pitch * th);
+		for(i=0; i<h; i++) {
+			get_row(src, y + i, x, w, row);
+			put_row(img, toffs + i, 0, w, row);
+		}
+		return;
+	}
+
+	nbytes = (w * bits + 7) / 8;
+	tail = (w * bits) % 8;
+	sptr = (unsigned char*)src->pixels + y * src->pitch + x * bits / 8;
+
+	for(i=0; i<h; i++) {
+		memcpy(dest, sptr, nbytes);
+		if(tail) {
+			dest[nbytes - 1] &= 0xff << (8 - tail);
+		}
+		if(nbytes < img->pitch) {
+			memset(dest + nbytes, 0, img->pitch - nbytes);
+		}
+		dest += img->pitch;
+		sptr += src->pitch;
+	}
+	if(h < th) {
+		memset(dest, 0, (th - h) * img->pitch);
+	}
+}
+
+static int init_tile_index(struct tile_index *tidx, struct image *img, int th, int flip)
+{
+	int i;
+
+	tidx->size = TIDX_INIT_SIZE;
+	tidx->count = 0;
+	tidx->tilesz = img->pitch * th;
+	tidx->flip = flip;
+	tidx->tw = img->width;
+	tidx->th = th;
+	tidx->pitch = img->pitch;
+	tidx->bpp = img->bpp;
+	tidx->var[0] = 0;
+
+	if(flip) {
+		if(!(tidx->var[0] = malloc(tidx->tilesz * 3))) {
+			fprintf(stderr, "img2tiles: failed to allocate flipped tile buffers\n");
+			return -1;
+		}
+		tidx->var[1] = tidx->var[0] + tidx->tilesz;
+		tidx->var[2] = tidx->var[1] + tidx->tilesz;
 	}
 
-	free(orig.pixels);
+	if(!(tidx->hash = malloc(tidx->size * (sizeof *tidx->hash + sizeof *tidx->tile)))) {
+		fprintf(stderr, "img2tiles: failed to allocate tile index\n");
+		free(tidx->var[0]);
+		return -1;
+	}
+	tidx->tile = (int*)(tidx->hash + tidx->size);
+	for(i=0; i<tidx->size; i++) {
+		tidx->tile[i] = -1;
+	}
 	return 0;
 }
 
-static int matchtile(struct image *img, int toffs, int th)
+static void destroy_tile_index(struct tile_index *tidx)
+{
+	free(tidx->var[0]);
+	free(tidx->hash);
+	tidx->hash = 0;
+	tidx->tile = 0;
+}
+
+/* 64bit hash of the tile bytes, a word at a time with a multiply-xorshift mix */
+static uint64_t tile_hash(const unsigned char *p, int size)
 {
-	int i, tilesz;
-	int ntiles = toffs / th;
-	unsigned char *pa, *pb;
+	int i;
+	uint64_t w, h = 0x9e3779b97f4a7c15ull ^ size;
 
-	tilesz = img->pitch * th;
-	pa = (unsigned char*)img->pixels;
-	pb = (unsigned char*)img->pixels + toffs * img->pitch;
+	for(i=0; i + 8 <= size; i+=8) {
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+	}
+	if(i < size) {
+		w = 0;
+		memcpy(&w, p + i, size - i);
+		h = (h ^ w) * 0xff51afd7ed558ccdull;
+	}
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	return h ^ (h >> 33);
+}
 
-	for(i=0; i<ntiles; i++) {
-		if(memcmp(pa, pb, tilesz) == 0) {
-			return i;
+static int tidx_insert(struct tile_index *tidx, uint64_t hash, int tile)
+{
+	int i, idx;
+	int oldsize = tidx->size;
+	uint64_t *oldhash = tidx->hash;
+	int *oldtile = tidx->tile;
+
+	/* keep the load factor under 1/2 to keep the probe sequences short */
+	if(++tidx->count > tidx->size / 2) {
+		tidx->size *= 2;
+		if(!(tidx->hash = malloc(tidx->size * (sizeof *tidx->hash + sizeof *tidx->tile)))) {
+			fprintf(stderr, "img2tiles: failed to resize tile index\n");
+			tidx->hash = oldhash;
+			tidx->size = oldsize;
+			tidx->count--;
+			return -1;
+		}
+		tidx->tile = (int*)(tidx->hash + tidx->size);
+		for(i=0; i<tidx->size; i++) {
+			tidx->tile[i] = -1;
+		}
+		for(i=0; i<oldsize; i++) {
+			if(oldtile[i] == -1) continue;
+			idx = oldhash[i] & (tidx->size - 1);
+			while(tidx->tile[idx] != -1) {
+				idx = (idx + 1) & (tidx->size - 1);
+			}
+			tidx->hash[idx] = oldhash[i];
+			tidx->tile[idx] = oldtile[i];
 		}
-		pa += tilesz;
+		free(oldhash);
+	}
+
+	idx = hash & (tidx->size - 1);
+	while(tidx->tile[idx] != -1) {
+		idx = (idx + 1) & (tidx->size - 1);
 	}
+	tidx->hash[idx] = hash;
+	tidx->tile[idx] = tile;
+	return 0;
+}
+
+/* flips a tile horizontally and/or vertically. Packed pixels of less than a
+ * byte are moved one at a time, most significant bits first.
+ */
+static void flip_tile(struct tile_index *tidx, unsigned char *dest, const unsigned char *src,
+		int hflip, int vflip)
+{
+	int x, y, sx, psz, ppb, shift, mask, pix;
+	const unsigned char *srow;
+	unsigned char *drow;
+
+	for(y=0; y<tidx->th; y++) {
+		srow = src + (vflip ? tidx->th - 1 - y : y) * tidx->pitch;
+		drow = dest + y * tidx->pitch;
+
+		if(!hflip) {
+			memcpy(drow, srow, tidx->pitch);
+		} else if(tidx->bpp >= 8) {
+			psz = (tidx->bpp + 7) / 8;
+			for(x=0; x<tidx->tw; x++) {
+				memcpy(drow + x * psz, srow + (tidx->tw - 1 - x) * psz, psz);
+			}
+		} else {
+			ppb = 8 / tidx->bpp;
+			mask = (1 << tidx->bpp) - 1;
+			memset(drow, 0, tidx->pitch);
+			for(x=0; x<tidx->tw; x++) {
+				sx = tidx->tw - 1 - x;
+				shift = 8 - tidx->bpp - (sx % ppb) * tidx->bpp;
+				pix = (srow[sx / ppb] >> shift) & mask;
+				shift = 8 - tidx->bpp - (x % ppb) * tidx->bpp;
+				drow[x / ppb] |= pix << shift;
+			}
+		}
+	}
+}
 
+/* Hash key of a tile in the index. When matching flipped tiles, it's the
+ * lowest hash of the tile and its flipped variants, which is the same for all
+ * of them. flipbuf is space for one tile.
+ */
+static uint64_t tile_key(struct tile_index *tidx, const unsigned char *tile, unsigned char *flipbuf)
+{
+	int i;
+	uint64_t hash, vhash;
+
+	hash = tile_hash(tile, tidx->tilesz);
+	if(tidx->flip) {
+		for(i=1; i<4; i++) {
+			flip_tile(tidx, flipbuf, tile, i & 1, i & 2);
+			vhash = tile_hash(flipbuf, tidx->tilesz);
+			if(vhash < hash) hash = vhash;
+		}
+	}
+	return hash;
+}
+
+/* Looks up tile t among the unique tiles before it, which are still in their
+ * original place in the strip, given by upos. Tiles are only compared byte by
+ * byte when their hashes match. When matching flipped tiles, the variants of
+ * the new tile are tried in order: as is, H, V, and HV flipped. The flips are
+ * their own inverse, so the variant which matches is also how to flip the
+ * unique tile to get the new one. Returns the unique tile number with the flip
+ * flags, or -1 if there's no match, in which case the new tile is added to the
+ * index as unique tile newid.
+ */
+static int matchtile(struct tile_index *tidx, struct image *img, int t, uint64_t hash,
+		const int *upos, int newid)
+{
+	int i, idx, nvar = 1;
+	unsigned char *tile, *other;
+	unsigned char *var[4];
+	static const int varflags[] = {0, TILE_HFLIP, TILE_VFLIP, TILE_HFLIP | TILE_VFLIP};
+
+	tile = (unsigned char*)img->pixels + t * tidx->tilesz;
+
+	idx = hash & (tidx->size - 1);
+	while(tidx->tile[idx] != -1) {
+		if(tidx->hash[idx] == hash) {
+			other = (unsigned char*)img->pixels + upos[tidx->tile[idx]] * tidx->tilesz;
+			if(memcmp(tile, other, tidx->tilesz) == 0) {
+				return tidx->tile[idx];
+			}
+
+			/* most duplicates aren't flipped, only flip if the tile is needed */
+			if(tidx->flip && nvar == 1) {
+				for(i=0; i<3; i++) {
+					var[i + 1] = tidx->var[i];
+					flip_tile(tidx, var[i + 1], tile, (i + 1) & 1, (i + 1) & 2);
+				}
+				nvar = 4;
+			}
+			for(i=1; i<nvar; i++) {
+				if(memcmp(var[i], other, tidx->tilesz) == 0) {
+					return tidx->tile[idx] | varflags[i];
+				}
+			}
+		}
+		idx = (idx + 1) & (tidx->size - 1);
+	}
+
+	tidx_insert(tidx, hash, newid);
 	return -1;
 }
 
-int dump_tilemap(struct tilemap *tmap, const char *fname)
+int dump_tilemap(struct tilemap *tmap, const char *fname, enum tilemap_format fmt)
 {
 	FILE *fp;
-	int i, sz = tmap->width * tmap->height;
-	uint16_t id;
+	int i, maxtile, noverflow = 0, sz = tmap->width * tmap->height;
+	unsigned int ent, hflag, vflag;
 
 	if(sz <= 0) return -1;
 
+	switch(fmt) {
+	case TMAP_SNES:
+		maxtile = 0x3ff;
+		hflag = 0x4000;
+		vflag = 0x8000;
+		break;
+	case TMAP_GBA:
+		maxtile = 0x3ff;
+		hflag = 0x400;
+		vflag = 0x800;
+		break;
+	case TMAP_MD:
+		maxtile = 0x7ff;
+		hflag = 0x800;
+		vflag = 0x1000;
+		break;
+	case TMAP_INDEX:
+	default:
+		maxtile = 0xffff;
+		hflag = vflag = 0;
+	}
+
+	/* tile numbers past maxtile would spill into the flip bits */
+	for(i=0; i<sz; i++) {
+		if(TILE_INDEX(tmap->map[i]) > maxtile) {
+			noverflow++;
+		}
+		if(!hflag && (tmap->map[i] & (TILE_HFLIP | TILE_VFLIP))) {
+			fprintf(stderr, "dump_tilemap: %s tilemaps can't store flipped tiles\n", tmap_format_names[fmt]);
+			return -1;
+		}
+	}
+	if(noverflow) {
+		fprintf(stderr, "dump_tilemap: %d entries refer to tiles past %d, which don't fit in a %s "
+				"tilemap (see -D <max tiles>)\n", noverflow, maxtile, tmap_format_names[fmt]);
+		return -1;
+	}
+
 	if(!(fp = fopen(fname, "wb"))) {
 		fprintf(stderr, "dump_tilemap: failed to open %s for writing\n", fname);
 		return -1;
 	}
 
 	for(i=0; i<sz; i++) {
-		/* XXX dump in 16bit big endian for the megadrive */
-		id = (tmap->map[i] << 8) | (tmap->map[i] >> 8);
-		fwrite(&id, sizeof id, 1, fp);
+		ent = TILE_INDEX(tmap->map[i]);
+		if(tmap->map[i] & TILE_HFLIP) ent |= hflag;
+		if(tmap->map[i] & TILE_VFLIP) ent |= vflag;
+
+		/* 16bit big endian for the megadrive and plain indices, little endian
+		 * for the others
+		 */
+		if(fmt == TMAP_MD || fmt == TMAP_INDEX) {
+			fputc(ent >> 8, fp);
+			fputc(ent & 0xff, fp);
+		} else {
+			fputc(ent & 0xff, fp);
+			fputc(ent >> 8, fp);
+		}
 	}
 
 	fclose(fp);
 	return 0;
 }
+
+int tilemap_format_from_name(const char *name)
+{
+	int i;
+
+	for(i=0; i<sizeof tmap_format_names / sizeof *tmap_format_names; i++) {
+		if(strcmp(name, tmap_format_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
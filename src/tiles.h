@@ -20,12 +20,36 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "image.h"
 
+/* tilemap entries are tile numbers, with these flags for flipped tiles */
+#define TILE_HFLIP		0x40000000
+#define TILE_VFLIP		0x20000000
+#define TILE_INDEX(x)	((x) & 0x1fffffff)
+
+enum {
+	DEDUP_NONE,
+	DEDUP_EXACT,
+	DEDUP_FLIP		/* also match horizontally/vertically flipped tiles */
+};
+
+/* tilemap file entry layouts */
+enum tilemap_format {
+	TMAP_INDEX,		/* 16bit big endian tile number, no flip bits (default) */
+	TMAP_MD,		/* 16bit big endian: 11 bits tile, H flip bit 11, V flip bit 12 */
+	TMAP_SNES,		/* 16bit little endian: 10 bits tile, H flip bit 14, V flip bit 15 */
+	TMAP_GBA		/* 16bit little endian: 10 bits tile, H flip bit 10, V flip bit 11 */
+};
+
 struct tilemap {
 	int width, height;
 	int *map;
 };
 
-int img2tiles(struct tilemap *tmap, struct image *img, int tw, int th, int dedup);
-int dump_tilemap(struct tilemap *tmap, const char *fname);
+/* maxtiles > 0 merges similar tiles after dedup, until there are no more than
+ * maxtiles left (see tilemerge.h)
+ */
+int img2tiles(struct tilemap *tmap, struct image *img, int tw, int th, int dedup, int maxtiles);
+int dump_tilemap(struct tilemap *tmap, const char *fname, enum tilemap_format fmt);
+/* returns a tilemap format for the -omf option, -1 if invalid */
+int tilemap_format_from_name(const char *name);
 
 #endif	/* TILES_H_ */
@@ -0,0 +1,210 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "tpool.h"
+
+struct work_item {
+	void *data;
+	tpool_callback work;
+	struct work_item *next;
+};
+
+struct thread_pool {
+	pthread_t *threads;
+	int num_threads;
+
+	struct work_item *workq, *workq_tail;
+	int nactive;
+	int quit;
+
+	pthread_mutex_t lock;
+	pthread_cond_t workq_cond;	/* signalled when work is added */
+	pthread_cond_t done_cond;	/* signalled when the pool goes idle */
+};
+
+struct job_batch {
+	tpool_job_func func;
+	void *cls;
+	int job;
+};
+
+struct thread_pool *tpool;
+
+static void *thread_func(void *arg);
+
+struct thread_pool *tpool_create(int num_threads)
+{
+	int i;
+	struct thread_pool *tp;
+
+	if(!(tp = calloc(1, sizeof *tp))) {
+		fprintf(stderr, "failed to allocate thread pool\n");
+		return 0;
+	}
+	if(!(tp->threads = malloc(num_threads * sizeof *tp->threads))) {
+		fprintf(stderr, "failed to allocate thread pool threads\n");
+		free(tp);
+		return 0;
+	}
+	pthread_mutex_init(&tp->lock, 0);
+	pthread_cond_init(&tp->workq_cond, 0);
+	pthread_cond_init(&tp->done_cond, 0);
+
+	for(i=0; i<num_threads; i++) {
+		if(pthread_create(tp->threads + i, 0, thread_func, tp) != 0) {
+			fprintf(stderr, "failed to create worker thread %d\n", i);
+			break;
+		}
+		tp->num_threads++;
+	}
+
+	if(!tp->num_threads) {
+		tpool_destroy(tp);
+		return 0;
+	}
+	return tp;
+}
+
+void tpool_destroy(struct thread_pool *tp)
+{
+	int i;
+	struct work_item *item;
+
+	if(!tp) return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->quit = 1;
+	pthread_cond_broadcast(&tp->workq_cond);
+	pthread_mutex_unlock(&tp->lock);
+
+	for(i=0; i<tp->num_threads; i++) {
+		pthread_join(tp->threads[i], 0);
+	}
+
+	while(tp->workq) {
+		item = tp->workq;
+		tp->workq = item->next;
+		free(item);
+	}
+
+	pthread_mutex_destroy(&tp->lock);
+	pthread_cond_destroy(&tp->workq_cond);
+	pthread_cond_destroy(&tp->done_cond);
+	free(tp->threads);
+	free(tp);
+}
+
+int tpool_num_threads(struct thread_pool *tp)
+{
+	return tp ? tp->num_threads : 1;
+}
+
+int tpool_enqueue(struct thread_pool *tp, void *data, tpool_callback work)
+{
+	struct work_item *item;
+
+	if(!(item = malloc(sizeof *item))) {
+		fprintf(stderr, "failed to allocate thread pool work item\n");
+		return -1;
+	}
+	item->data = data;
+	item->work = work;
+	item->next = 0;
+
+	pthread_mutex_lock(&tp->lock);
+	if(tp->workq) {
+		tp->workq_tail->next = item;
+	} else {
+		tp->workq = item;
+	}
+	tp->workq_tail = item;
+	pthread_cond_signal(&tp->workq_cond);
+	pthread_mutex_unlock(&tp->lock);
+	return 0;
+}
+
+void tpool_wait(struct thread_pool *tp)
+{
+	pthread_mutex_lock(&tp->lock);
+	while(tp->workq || tp->nactive) {
+		pthread_cond_wait(&tp->done_cond, &tp->lock);
+	}
+	pthread_mutex_unlock(&tp->lock);
+}
+
+static void run_job(void *data)
+{
+	struct job_batch *jb = data;
+	jb->func(jb->cls, jb->job);
+}
+
+void tpool_run(struct thread_pool *tp, int njobs, tpool_job_func func, void *cls)
+{
+	int i = 0;
+	struct job_batch *jobs = 0;
+
+	if(tp && njobs > 1 && (jobs = malloc(njobs * sizeof *jobs))) {
+		for(i=0; i<njobs; i++) {
+			jobs[i].func = func;
+			jobs[i].cls = cls;
+			jobs[i].job = i;
+			if(tpool_enqueue(tp, jobs + i, run_job) == -1) {
+				break;
+			}
+		}
+		tpool_wait(tp);
+	}
+
+	/* single-threaded, or whatever didn't make it into the queue, runs here */
+	for(; i<njobs; i++) {
+		func(cls, i);
+	}
+	free(jobs);
+}
+
+static void *thread_func(void *arg)
+{
+	struct thread_pool *tp = arg;
+	struct work_item *item;
+
+	pthread_mutex_lock(&tp->lock);
+	for(;;) {
+		while(!tp->workq && !tp->quit) {
+			pthread_cond_wait(&tp->workq_cond, &tp->lock);
+		}
+		if(tp->quit) break;
+
+		item = tp->workq;
+		tp->workq = item->next;
+		if(!tp->workq) tp->workq_tail = 0;
+		tp->nactive++;
+		pthread_mutex_unlock(&tp->lock);
+
+		item->work(item->data);
+		free(item);
+
+		pthread_mutex_lock(&tp->lock);
+		if(--tp->nactive == 0 && !tp->workq) {
+			pthread_cond_broadcast(&tp->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&tp->lock);
+	return 0;
+}
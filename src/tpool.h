@@ -0,0 +1,45 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TPOOL_H_
+#define TPOOL_H_
+
+struct thread_pool;
+
+typedef void (*tpool_callback)(void *data);
+typedef void (*tpool_job_func)(void *cls, int job);
+
+/* worker pool shared by everything, created by main for -j N, with N > 1.
+ * It's null when running single-threaded.
+ */
+extern struct thread_pool *tpool;
+
+struct thread_pool *tpool_create(int num_threads);
+void tpool_destroy(struct thread_pool *tp);
+
+int tpool_num_threads(struct thread_pool *tp);
+
+int tpool_enqueue(struct thread_pool *tp, void *data, tpool_callback work);
+/* waits until the queue is empty and all workers are idle */
+void tpool_wait(struct thread_pool *tp);
+
+/* calls func(cls, i) for every i in [0, njobs) and waits for all of them to
+ * finish. Runs them in order on the calling thread if tp is null.
+ */
+void tpool_run(struct thread_pool *tp, int njobs, tpool_job_func func, void *cls);
+
+#endif	/* TPOOL_H_ */
@@ -0,0 +1,40 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <time.h>
+#include <sys/stat.h>
+#include "util.h"
+
+int verbose;
+
+double get_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int same_file(const char *a, const char *b)
+{
+	struct stat sta, stb;
+
+	if(!a || !b || stat(a, &sta) == -1 || stat(b, &stb) == -1) {
+		return 0;
+	}
+	return sta.st_dev == stb.st_dev && sta.st_ino == stb.st_ino;
+}
@@ -0,0 +1,36 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef UTIL_H_
+#define UTIL_H_
+
+extern int verbose;
+
+/* monotonic time in milliseconds, for the -v timing output */
+double get_msec(void);
+
+/* true if both paths name the same existing file */
+int same_file(const char *a, const char *b);
+
+#define VERBOSE_TIME(t0, what) \
+	do { \
+		if(verbose) { \
+			fprintf(stderr, "%s: %.2f ms\n", what, get_msec() - (t0)); \
+		} \
+	} while(0)
+
+#endif	/* UTIL_H_ */
@@ -0,0 +1,324 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wu.h"
+
+#define SIDE		33
+#define TABSZ		(SIDE * SIDE * SIDE)
+#define IDX(r, g, b)	(((r) * SIDE + (g)) * SIDE + (b))
+
+enum { RED, GREEN, BLUE };
+
+/* box in the grid, lower bounds exclusive */
+struct box {
+	int r0, r1, g0, g1, b0, b1;
+	int vol;
+};
+
+static void cumulate(struct wu_quant *wu);
+static int cut(struct wu_quant *wu, struct box *a, struct box *b);
+static double variance(struct wu_quant *wu, struct box *box);
+static int64_t volume(int64_t *m, struct box *box);
+
+int wu_init(struct wu_quant *wu)
+{
+	wu->wt = calloc(TABSZ, sizeof *wu->wt);
+	wu->mr = calloc(TABSZ, sizeof *wu->mr);
+	wu->mg = calloc(TABSZ, sizeof *wu->mg);
+	wu->mb = calloc(TABSZ, sizeof *wu->mb);
+	wu->m2 = calloc(TABSZ, sizeof *wu->m2);
+
+	if(!wu->wt || !wu->mr || !wu->mg || !wu->mb || !wu->m2) {
+		fprintf(stderr, "failed to allocate quantizer moment tables\n");
+		wu_destroy(wu);
+		return -1;
+	}
+	return 0;
+}
+
+void wu_destroy(struct wu_quant *wu)
+{
+	free(wu->wt);
+	free(wu->mr);
+	free(wu->mg);
+	free(wu->mb);
+	free(wu->m2);
+	wu->wt = wu->mr = wu->mg = wu->mb = 0;
+	wu->m2 = 0;
+}
+
+void wu_add(struct wu_quant *wu, int r, int g, int b, int64_t weight)
+{
+	int idx = IDX((r >> 3) + 1, (g >> 3) + 1, (b >> 3) + 1);
+
+	wu->wt[idx] += weight;
+	wu->mr[idx] += weight * r;
+	wu->mg[idx] += weight * g;
+	wu->mb[idx] += weight * b;
+	wu->m2[idx] += (double)weight * (r * r + g * g + b * b);
+}
+
+int wu_palette(struct wu_quant *wu, int maxcol, struct cmapent *cmap)
+{
+	int i, j, next, ncolors;
+	struct box box[256];
+	double vv[256];
+	int64_t w;
+
+	cumulate(wu);
+
+	box[0].r0 = box[0].g0 = box[0].b0 = 0;
+	box[0].r1 = box[0].g1 = box[0].b1 = SIDE - 1;
+	box[0].vol = (SIDE - 1) * (SIDE - 1) * (SIDE - 1);
+
+	ncolors = 1;
+	next = 0;
+	for(i=1; i<maxcol; i++) {
+		if(cut(wu, box + next, box + i)) {
+			vv[next] = box[next].vol > 1 ? variance(wu, box + next) : 0.0;
+			vv[i] = box[i].vol > 1 ? variance(wu, box + i) : 0.0;
+			ncolors = i + 1;
+		} else {
+			vv[next] = 0.0;		/* can't split this one any further */
+			i--;
+		}
+
+		/* split the box with the largest variance next */
+		next = 0;
+		for(j=1; j<=i; j++) {
+			if(vv[j] > vv[next]) next = j;
+		}
+		if(vv[next] <= 0.0) break;
+	}
+
+	for(i=0; i<ncolors; i++) {
+		if((w = volume(wu->wt, box + i)) <= 0) {
+			cmap[i].r = cmap[i].g = cmap[i].b = 0;
+			continue;
+		}
+		cmap[i].r = (volume(wu->mr, box + i) + w / 2) / w;
+		cmap[i].g = (volume(wu->mg, box + i) + w / 2) / w;
+		cmap[i].b = (volume(wu->mb, box + i) + w / 2) / w;
+	}
+	return ncolors;
+}
+
+/* turn the binned moments into cumulative moments, so that each entry holds
+ * the sum over the box from the origin to that entry
+ */
+static void cumulate(struct wu_quant *wu)
+{
+	int r, g, b, idx;
+	int64_t line, line_r, line_g, line_b;
+	int64_t area[SIDE], area_r[SIDE], area_g[SIDE], area_b[SIDE];
+	double line2, area2[SIDE];
+
+	for(r=1; r<SIDE; r++) {
+		memset(area, 0, sizeof area);
+		memset(area_r, 0, sizeof area_r);
+		memset(area_g, 0, sizeof area_g);
+		memset(area_b, 0, sizeof area_b);
+		memset(area2, 0, sizeof area2);
+
+		for(g=1; g<SIDE; g++) {
+			line = line_r = line_g = line_b = 0;
+			line2 = 0.0;
+
+			for(b=1; b<SIDE; b++) {
+				idx = IDX(r, g, b);
+
+				line += wu->wt[idx];
+				line_r += wu->mr[idx];
+				line_g += wu->mg[idx];
+				line_b += wu->mb[idx];
+				line2 += wu->m2[idx];
+
+				area[b] += line;
+				area_r[b] += line_r;
+				area_g[b] += line_g;
+				area_b[b] += line_b;
+				area2[b] += line2;
+
+				wu->wt[idx] = wu->wt[IDX(r - 1, g, b)] + area[b];
+				wu->mr[idx] = wu->mr[IDX(r - 1, g, b)] + area_r[b];
+				wu->mg[idx] = wu->mg[IDX(r - 1, g, b)] + area_g[b];
+				wu->mb[idx] = wu->mb[IDX(r - 1, g, b)] + area_b[b];
+				wu->m2[idx] = wu->m2[IDX(r - 1, g, b)] + area2[b];
+			}
+		}
+	}
+}
+
+static int64_t volume(int64_t *m, struct box *box)
+{
+	return m[IDX(box->r1, box->g1, box->b1)] - m[IDX(box->r1, box->g1, box->b0)]
+		- m[IDX(box->r1, box->g0, box->b1)] + m[IDX(box->r1, box->g0, box->b0)]
+		- m[IDX(box->r0, box->g1, box->b1)] + m[IDX(box->r0, box->g1, box->b0)]
+		+ m[IDX(box->r0, box->g0, box->b1)] - m[IDX(box->r0, box->g0, box->b0)];
+}
+
+static double volume2(double *m, struct box *box)
+{
+	return m[IDX(box->r1, box->g1, box->b1)] - m[IDX(box->r1, box->g1, box->b0)]
+		- m[IDX(box->r1, box->g0, box->b1)] + m[IDX(box->r1, box->g0, box->b0)]
+		- m[IDX(box->r0, box->g1, box->b1)] + m[IDX(box->r0, box->g1, box->b0)]
+		+ m[IDX(box->r0, box->g0, box->b1)] - m[IDX(box->r0, box->g0, box->b0)];
+}
+
+/* the part of the volume sum which doesn't depend on the cut position along
+ * dir, negated
+ */
+static int64_t bottom(int64_t *m, struct box *box, int dir)
+{
+	switch(dir) {
+	case RED:
+		return -m[IDX(box->r0, box->g1, box->b1)] + m[IDX(box->r0, box->g1, box->b0)]
+			+ m[IDX(box->r0, box->g0, box->b1)] - m[IDX(box->r0, box->g0, box->b0)];
+	case GREEN:
+		return -m[IDX(box->r1, box->g0, box->b1)] + m[IDX(box->r1, box->g0, box->b0)]
+			+ m[IDX(box->r0, box->g0, box->b1)] - m[IDX(box->r0, box->g0, box->b0)];
+	default:
+		return -m[IDX(box->r1, box->g1, box->b0)] + m[IDX(box->r1, box->g0, box->b0)]
+			+ m[IDX(box->r0, box->g1, box->b0)] - m[IDX(box->r0, box->g0, box->b0)];
+	}
+}
+
+/* the rest of the volume sum, with the box cut at pos along dir */
+static int64_t top(int64_t *m, struct box *box, int dir, int pos)
+{
+	switch(dir) {
+	case RED:
+		return m[IDX(pos, box->g1, box->b1)] - m[IDX(pos, box->g1, box->b0)]
+			- m[IDX(pos, box->g0, box->b1)] + m[IDX(pos, box->g0, box->b0)];
+	case GREEN:
+		return m[IDX(box->r1, pos, box->b1)] - m[IDX(box->r1, pos, box->b0)]
+			- m[IDX(box->r0, pos, box->b1)] + m[IDX(box->r0, pos, box->b0)];
+	default:
+		return m[IDX(box->r1, box->g1, pos)] - m[IDX(box->r1, box->g0, pos)]
+			- m[IDX(box->r0, box->g1, pos)] + m[IDX(box->r0, box->g0, pos)];
+	}
+}
+
+/* weighted variance of a box, scaled by its weight */
+static double variance(struct wu_quant *wu, struct box *box)
+{
+	double dr, dg, db, w;
+
+	dr = (double)volume(wu->mr, box);
+	dg = (double)volume(wu->mg, box);
+	db = (double)volume(wu->mb, box);
+	w = (double)volume(wu->wt, box);
+
+	return volume2(wu->m2, box) - (dr * dr + dg * dg + db * db) / w;
+}
+
+/* find the cut along dir which maximizes the sum of the squared mean of the two
+ * halves, which is the same as minimizing the sum of their variances
+ */
+static double maximize(struct wu_quant *wu, struct box *box, int dir, int first, int last,
+		int *cutpos, int64_t whole_r, int64_t whole_g, int64_t whole_b, int64_t whole_w)
+{
+	int i;
+	int64_t base_r, base_g, base_b, base_w;
+	double half_r, half_g, half_b, half_w, temp, max = 0.0;
+
+	base_r = bottom(wu->mr, box, dir);
+	base_g = bottom(wu->mg, box, dir);
+	base_b = bottom(wu->mb, box, dir);
+	base_w = bottom(wu->wt, box, dir);
+
+	*cutpos = -1;
+	for(i=first; i<last; i++) {
+		half_r = (double)(base_r + top(wu->mr, box, dir, i));
+		half_g = (double)(base_g + top(wu->mg, box, dir, i));
+		half_b = (double)(base_b + top(wu->mb, box, dir, i));
+		half_w = (double)(base_w + top(wu->wt, box, dir, i));
+		if(half_w <= 0.0) continue;		/* empty lower half */
+
+		temp = (half_r * half_r + half_g * half_g + half_b * half_b) / half_w;
+
+		half_r = (double)whole_r - half_r;
+		half_g = (double)whole_g - half_g;
+		half_b = (double)whole_b - half_b;
+		half_w = (double)whole_w - half_w;
+		if(half_w <= 0.0) continue;		/* empty upper half */
+
+		temp += (half_r * half_r + half_g * half_g + half_b * half_b) / half_w;
+
+		if(temp > max) {
+			max = temp;
+			*cutpos = i;
+		}
+	}
+	return max;
+}
+
+/* split box a in two along its best plane, the upper half goes to b. Returns 0
+ * if a can't be split.
+ */
+static int cut(struct wu_quant *wu, struct box *a, struct box *b)
+{
+	int dir, cut_r, cut_g, cut_b;
+	double max_r, max_g, max_b;
+	int64_t whole_r, whole_g, whole_b, whole_w;
+
+	whole_r = volume(wu->mr, a);
+	whole_g = volume(wu->mg, a);
+	whole_b = volume(wu->mb, a);
+	whole_w = volume(wu->wt, a);
+
+	max_r = maximize(wu, a, RED, a->r0 + 1, a->r1, &cut_r, whole_r, whole_g, whole_b, whole_w);
+	max_g = maximize(wu, a, GREEN, a->g0 + 1, a->g1, &cut_g, whole_r, whole_g, whole_b, whole_w);
+	max_b = maximize(wu, a, BLUE, a->b0 + 1, a->b1, &cut_b, whole_r, whole_g, whole_b, whole_w);
+
+	if(max_r >= max_g && max_r >= max_b) {
+		if(cut_r < 0) return 0;		/* all of the weight is on one side */
+		dir = RED;
+	} else if(max_g >= max_r && max_g >= max_b) {
+		dir = GREEN;
+	} else {
+		dir = BLUE;
+	}
+
+	b->r1 = a->r1;
+	b->g1 = a->g1;
+	b->b1 = a->b1;
+
+	switch(dir) {
+	case RED:
+		b->r0 = a->r1 = cut_r;
+		b->g0 = a->g0;
+		b->b0 = a->b0;
+		break;
+	case GREEN:
+		b->g0 = a->g1 = cut_g;
+		b->r0 = a->r0;
+		b->b0 = a->b0;
+		break;
+	default:
+		b->b0 = a->b1 = cut_b;
+		b->r0 = a->r0;
+		b->g0 = a->g0;
+	}
+
+	a->vol = (a->r1 - a->r0) * (a->g1 - a->g0) * (a->b1 - a->b0);
+	b->vol = (b->r1 - b->r0) * (b->g1 - b->g0) * (b->b1 - b->b0);
+	return 1;
+}
@@ -0,0 +1,43 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef WU_H_
+#define WU_H_
+
+#include <stdint.h>
+#include "image.h"
+
+/* Xiaolin Wu's color quantizer: colors are binned into a 33^3 grid (5 bits
+ * per channel plus a zero border), turned into cumulative moment tables, and
+ * the color cube is split recursively along the plane which minimizes the sum
+ * of the variances of the two halves.
+ */
+struct wu_quant {
+	int64_t *wt, *mr, *mg, *mb;
+	double *m2;
+};
+
+int wu_init(struct wu_quant *wu);
+void wu_destroy(struct wu_quant *wu);
+
+/* add a color with the given weight, before calling wu_palette */
+void wu_add(struct wu_quant *wu, int r, int g, int b, int64_t weight);
+
+/* returns the number of palette entries generated, at most maxcol */
+int wu_palette(struct wu_quant *wu, int maxcol, struct cmapent *cmap);
+
+#endif	/* WU_H_ */
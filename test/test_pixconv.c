@@ -0,0 +1,272 @@
+/*
+imgquant - image processing tool for retro platform graphics hacking
+Copyright (C) 2021-2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* checks every code path of the pixel conversions against known values, that
+ * the SSE2 and AVX2 code matches the scalar code bit for bit, and that none of
+ * them write past the end of the output row.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/pixconv.h"
+
+#define MAX_ROW		40
+#define NUM_ROWS	64
+#define GUARD		64
+#define GUARD_BYTE	0xa5
+
+static const char *isa_names[] = {"auto", "scalar", "SSE2", "AVX2"};
+
+static int num_fail;
+
+/* output buffers are followed by GUARD bytes which must stay untouched */
+static void *alloc_out(int size)
+{
+	unsigned char *buf;
+
+	if(!(buf = malloc(size + GUARD))) {
+		perror("failed to allocate output buffer");
+		exit(1);
+	}
+	memset(buf, GUARD_BYTE, size + GUARD);
+	return buf;
+}
+
+static int check_out(const char *name, int isa, int n, const void *ref, const void *res, int size)
+{
+	int i;
+	const unsigned char *guard = (const unsigned char*)res + size;
+
+	if(memcmp(ref, res, size) != 0) {
+		fprintf(stderr, "%s %s: mismatch with the scalar code for %d pixels\n",
+				name, isa_names[isa], n);
+		num_fail++;
+		return -1;
+	}
+	for(i=0; i<GUARD; i++) {
+		if(guard[i] != GUARD_BYTE) {
+			fprintf(stderr, "%s %s: wrote past the end of %d pixels\n", name, isa_names[isa], n);
+			num_fail++;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* known conversions, each repeated over a whole row so that the SIMD code
+ * handles them too, not just the scalar tail
+ */
+static const struct {
+	uint16_t pix;
+	unsigned char rgb[3];
+} known_565[] = {
+	{0xffff, {0xff, 0xff, 0xff}},
+	{0x0000, {0x00, 0x00, 0x00}},
+	{0xf800, {0xff, 0x00, 0x00}},
+	{0x07e0, {0x00, 0xff, 0x00}},
+	{0x001f, {0x00, 0x00, 0xff}},
+	{0x8410, {0x84, 0x82, 0x84}}
+}, known_555[] = {
+	{0x7fff, {0xff, 0xff, 0xff}},
+	{0x001f, {0xff, 0x00, 0x00}},
+	{0x03e0, {0x00, 0xff, 0x00}},
+	{0x7c00, {0x00, 0x00, 0xff}},
+	{0x0421, {0x08, 0x08, 0x08}}
+}, known_to555[] = {
+	{0x001f, {0xff, 0x00, 0x00}},
+	{0x03e0, {0x00, 0xff, 0x00}},
+	{0x7c00, {0x00, 0x00, 0xff}},
+	{0x7fff, {0xff, 0xff, 0xff}},
+	{0x4041, {0x0f, 0x17, 0x87}}
+};
+
+#define NKNOWN(a)	(sizeof a / sizeof *a)
+
+static void test_known(int isa)
+{
+	int i, j;
+	uint16_t pix[MAX_ROW];
+	unsigned char rgb[MAX_ROW * 3], rgba[MAX_ROW * 4];
+
+	pixconv_set_isa(isa);
+
+	for(i=0; i<NKNOWN(known_565) + NKNOWN(known_555); i++) {
+		int is565 = i < NKNOWN(known_565);
+		int k = is565 ? i : i - NKNOWN(known_565);
+		uint16_t val = is565 ? known_565[k].pix : known_555[k].pix;
+		const unsigned char *exp = is565 ? known_565[k].rgb : known_555[k].rgb;
+
+		for(j=0; j<MAX_ROW; j++) {
+			pix[j] = val;
+		}
+		if(is565) {
+			conv_rgb565_rgb24(pix, rgb, MAX_ROW);
+		} else {
+			conv_bgr555_rgb24(pix, rgb, MAX_ROW);
+		}
+		for(j=0; j<MAX_ROW; j++) {
+			if(memcmp(rgb + j * 3, exp, 3) != 0) {
+				fprintf(stderr, "%s %s: %04x -> %02x,%02x,%02x at pixel %d, expected %02x,%02x,%02x\n",
+						is565 ? "rgb565_rgb24" : "bgr555_rgb24", isa_names[isa], val,
+						rgb[j * 3], rgb[j * 3 + 1], rgb[j * 3 + 2], j, exp[0], exp[1], exp[2]);
+				num_fail++;
+				break;
+			}
+		}
+	}
+
+	for(i=0; i<NKNOWN(known_to555); i++) {
+		const unsigned char *c = known_to555[i].rgb;
+
+		for(j=0; j<MAX_ROW; j++) {
+			memcpy(rgb + j * 3, c, 3);
+			memcpy(rgba + j * 4, c, 3);
+			rgba[j * 4 + 3] = 0xff;
+		}
+		conv_rgb24_bgr555(rgb, pix, MAX_ROW);
+		for(j=0; j<MAX_ROW; j++) {
+			if(pix[j] != known_to555[i].pix) {
+				fprintf(stderr, "rgb24_bgr555 %s: %02x,%02x,%02x -> %04x at pixel %d, expected %04x\n",
+						isa_names[isa], c[0], c[1], c[2], pix[j], j, known_to555[i].pix);
+				num_fail++;
+				break;
+			}
+		}
+		conv_rgba32_bgr555(rgba, pix, MAX_ROW);
+		for(j=0; j<MAX_ROW; j++) {
+			if(pix[j] != known_to555[i].pix) {
+				fprintf(stderr, "rgba32_bgr555 %s: %02x,%02x,%02x -> %04x at pixel %d, expected %04x\n",
+						isa_names[isa], c[0], c[1], c[2], pix[j], j, known_to555[i].pix);
+				num_fail++;
+				break;
+			}
+		}
+	}
+}
+
+static void test_to_rgb24(const char *name, int isa,
+		void (*conv)(const uint16_t*, unsigned char*, int))
+{
+	int i, j, n;
+	uint16_t *src;
+	unsigned char *ref, *res;
+
+	/* every possible input pixel in one long row */
+	src = malloc(65536 * sizeof *src);
+	ref = alloc_out(65536 * 3);
+	res = alloc_out(65536 * 3);
+	if(!src) {
+		perror("failed to allocate source buffer");
+		exit(1);
+	}
+	for(i=0; i<65536; i++) {
+		src[i] = i;
+	}
+	pixconv_set_isa(PIXCONV_SCALAR);
+	conv(src, ref, 65536);
+	pixconv_set_isa(isa);
+	conv(src, res, 65536);
+	check_out(name, isa, 65536, ref, res, 65536 * 3);
+	free(src);
+	free(ref);
+	free(res);
+
+	/* short rows for the tails, each in a buffer of exactly its size */
+	for(n=0; n<=MAX_ROW; n++) {
+		for(i=0; i<NUM_ROWS; i++) {
+			src = malloc(n ? n * sizeof *src : 1);
+			ref = alloc_out(n * 3);
+			res = alloc_out(n * 3);
+			if(!src) {
+				perror("failed to allocate source buffer");
+				exit(1);
+			}
+			for(j=0; j<n; j++) {
+				src[j] = rand();
+			}
+			pixconv_set_isa(PIXCONV_SCALAR);
+			conv(src, ref, n);
+			pixconv_set_isa(isa);
+			conv(src, res, n);
+			check_out(name, isa, n, ref, res, n * 3);
+			free(src);
+			free(ref);
+			free(res);
+		}
+	}
+}
+
+static void test_to_bgr555(const char *name, int isa, int bytespp,
+		void (*conv)(const unsigned char*, uint16_t*, int))
+{
+	int i, j, n;
+	unsigned char *src;
+	uint16_t *ref, *res;
+
+	for(n=0; n<=MAX_ROW; n++) {
+		for(i=0; i<NUM_ROWS; i++) {
+			src = malloc(n ? n * bytespp : 1);
+			ref = alloc_out(n * sizeof *ref);
+			res = alloc_out(n * sizeof *res);
+			if(!src) {
+				perror("failed to allocate source buffer");
+				exit(1);
+			}
+			for(j=0; j<n * bytespp; j++) {
+				src[j] = rand();
+			}
+			pixconv_set_isa(PIXCONV_SCALAR);
+			conv(src, ref, n);
+			pixconv_set_isa(isa);
+			conv(src, res, n);
+			check_out(name, isa, n, ref, res, n * sizeof *ref);
+			free(src);
+			free(ref);
+			free(res);
+		}
+	}
+}
+
+int main(void)
+{
+	int isa;
+
+	srand(1);
+
+	test_known(PIXCONV_SCALAR);
+	printf("pixconv: %s tested\n", isa_names[PIXCONV_SCALAR]);
+
+	for(isa=PIXCONV_SSE2; isa<=PIXCONV_AVX2; isa++) {
+		if(pixconv_set_isa(isa) == -1) {
+			printf("pixconv: %s not supported by this CPU, skipping\n", isa_names[isa]);
+			continue;
+		}
+		test_known(isa);
+		test_to_rgb24("rgb565_rgb24", isa, conv_rgb565_rgb24);
+		test_to_rgb24("bgr555_rgb24", isa, conv_bgr555_rgb24);
+		test_to_bgr555("rgb24_bgr555", isa, 3, conv_rgb24_bgr555);
+		test_to_bgr555("rgba32_bgr555", isa, 4, conv_rgba32_bgr555);
+		printf("pixconv: %s tested\n", isa_names[isa]);
+	}
+
+	if(num_fail) {
+		fprintf(stderr, "pixconv: %d failures\n", num_fail);
+		return 1;
+	}
+	printf("pixconv: all tests passed\n");
+	return 0;
+}